@@ -1,12 +1,31 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <sched.h>
+#include <time.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <poll.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/errno.h>
 #include <sys/user.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/vfio.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
 
 #define MPI2_DOORBELL               0x00
@@ -47,6 +66,25 @@
 #define MPI2_HCDW_ADDR_LOW          0x78
 #define MPI2_HCDW_ADDR_HIGH         0x7C
 
+// MPI2 firmware image header
+#define MPI2_FW_SIGNATURE           0x00
+#define MPI2_FW_SIGNATURE_MASK      0xFF000000
+#define MPI2_FW_SIGNATURE_VALUE     0xEA000000
+#define MPI2_FW_SIGNATURE0          0x04
+#define MPI2_FW_SIGNATURE0_VALUE    0x5AFAA55A
+#define MPI2_FW_SIGNATURE1          0x08
+#define MPI2_FW_SIGNATURE1_VALUE    0xA55AFAA5
+#define MPI2_FW_SIGNATURE2          0x0C
+#define MPI2_FW_SIGNATURE2_VALUE    0x5AA55AFA
+#define MPI2_FW_VENDOR_ID           0x20
+#define MPI2_FW_PRODUCT_ID          0x22
+#define MPI2_FW_PID_TYPE_MASK       0xF000
+#define MPI2_FW_PID_TYPE_SAS        0x2000
+#define MPI2_FW_PID_FAMILY_MASK     0x00FF
+#define MPI2_FW_PID_FAMILY_SAS2     0x0013
+#define MPI2_FW_IMAGE_SIZE          0x2C
+#define MPI2_FW_HEADER_SIZE         0x100
+
 #define MR_DIAG_RW_DATA             0x24
 #define MR_DIAG_RW_ADDRESS_LOW      0x28
 #define MR_DIAG_RW_ADDRESS_HIGH     0x2c
@@ -56,6 +94,8 @@
 #define DCR_I2C_SELECT          0x307
 #define DCR_SBR_CONFIG          0x340
 
+// Only the raw pin and reset registers of the on-chip I2C block are known;
+// its byte and transaction registers are undocumented, so the bus is bit-banged
 #define CHIP_I2C_BASE           0xC2100000
 #define CHIP_I2C_PINS           (CHIP_I2C_BASE + 0x20)
 #define CHIP_I2C_SCL_RD         0x01
@@ -67,827 +107,5617 @@
 #define EEPROM_TYPE_16BIT       0x01
 #define EEPROM_TYPE_8BIT        0x02
 
-#define HCDW_SIZE 0x200000
+// The HCDW is a power of two in size, at least one 2MB hugepage and at most
+// one 1GB hugepage.
+#define HCDW_MIN_SIZE 0x200000
+#define HCDW_MAX_SIZE 0x40000000
+#define FW_CACHE_DIR "/dev/hugepages/lsirec"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define I2C_SPEED_DEFAULT       100000
+
+// Default time allowed for the IOC to reach READY after reset/boot
+#define IOC_TIMEOUT_DEFAULT     2000
+
+// Time the chip needs after a diag reset before it may be accessed again
+#define IOC_RESET_READ_DELAY_US 50000
+// Longest and shortest poll intervals while waiting for the IOC
+#define IOC_POLL_MIN_US         10
+#define IOC_POLL_MAX_US         10000
+
+#define INVENTORY_DEFAULT       "/var/cache/lsirec/inventory"
+
+#define LSI_MODE_MPT            1
+#define LSI_MODE_MEGARAID       2
+
+#define SBR_SIZE                0x100
+#define SBR_MFG_SIZE            0x4c
+#define SBR_MFG0                0x00
+#define SBR_MFG1                0x4c
+#define SBR_SAS_ADDR            0xd8
+#define SBR_SAS_ADDR_CSUM       0xef
+
+#define EEPROM_PAGE_8BIT        8
+#define EEPROM_PAGE_16BIT       32
+
+// Read back and rewrite failed pages this many times before giving up
+#define SBR_VERIFY_RETRIES      3
+
+// Longest EEPROM write cycle we are willing to ACK poll for
+#define EEPROM_WRITE_TIMEOUT_NS 20000000
 
 typedef struct {
-    char pci_id[16];
+    int i2c_speed;
+    int realtime;
+    int page_size;
+    int no_verify;
+    int reprobe;
+    int timeout_ms;
+    int vfio;
+    int stats;
+    const char *connect;
+    // Where "-" output files go; stdout itself then carries the messages
+    int data_fd;
+    int force;
+    // Size of 16-bit addressed EEPROMs, overriding detection
+    int eeprom_size;
+    // Drop progress messages while scan probes adapters
+    int quiet;
+    // Keep staged firmware in files here, reused by later runs
+    const char *fw_cache;
+    // Structured results go here; stdout then carries the messages
+    int json;
+    int json_fd;
+} lsi_opts_t;
+
+static lsi_opts_t opts = {
+    .i2c_speed = I2C_SPEED_DEFAULT,
+    .timeout_ms = IOC_TIMEOUT_DEFAULT,
+    .data_fd = -1,
+    .json_fd = -1,
+};
+
+// Set by SIGINT/SIGTERM in serve and watch; lsi_watch_stop only ends a watch
+static volatile sig_atomic_t lsi_quit, lsi_watch_stop;
+
+static void lsi_info(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static void lsi_info(const char *fmt, ...)
+{
+    va_list ap;
+
+    if (opts.quiet)
+        return;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+static void lsi_signal(int sig)
+{
+    lsi_quit = 1;
+}
+
+// Stops the watch, and still leaves the signal pending for serve mode
+static void lsi_watch_signal(int sig)
+{
+    lsi_watch_stop = 1;
+    lsi_quit = 1;
+}
+
+// Manufacturing data fields, as in sbrtool.py (little endian)
+typedef struct {
+    const char *name;
+    uint8_t offset;
+    uint8_t size;
+} sbr_field_t;
+
+static const sbr_field_t sbr_fields[] = {
+    { "Unk00",      0x00, 4 },
+    { "Unk04",      0x04, 4 },
+    { "Unk08",      0x08, 4 },
+    { "PCIVID",     0x0c, 2 },
+    { "PCIPID",     0x0e, 2 },
+    { "Unk10",      0x10, 2 },
+    { "HwConfig",   0x12, 2 },
+    { "SubsysVID",  0x14, 2 },
+    { "SubsysPID",  0x16, 2 },
+    { "Unk18",      0x18, 4 },
+    { "Unk1c",      0x1c, 4 },
+    { "Unk20",      0x20, 4 },
+    { "Unk24",      0x24, 4 },
+    { "Unk28",      0x28, 4 },
+    { "Unk2c",      0x2c, 4 },
+    { "Unk30",      0x30, 4 },
+    { "Unk34",      0x34, 4 },
+    { "Unk38",      0x38, 4 },
+    { "Unk3c",      0x3c, 4 },
+    { "Interface",  0x40, 1 },
+    { "Unk41",      0x41, 1 },
+    { "Unk42",      0x42, 2 },
+    { "Unk44",      0x44, 4 },
+    { "Unk48",      0x48, 2 },
+    { "Unk4a",      0x4a, 1 },
+    { NULL },
+};
+
+typedef struct lsi_emu lsi_emu_t;
+
+// --stats instrumentation
+enum {
+    CNT_READ32,
+    CNT_WRITE32,
+    CNT_CHIP_READ,
+    CNT_CHIP_WRITE,
+    CNT_DCR_READ,
+    CNT_DCR_WRITE,
+    CNT_IOC_POLL,
+    CNT_MAX,
+};
+
+enum {
+    TIMER_I2C_START,
+    TIMER_I2C_STOP,
+    TIMER_I2C_BIT,
+    TIMER_I2C_BYTE,
+    TIMER_I2C_DELAY,
+    TIMER_MAX,
+};
+
+typedef struct {
+    unsigned long count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} lsi_timer_t;
+
+// read32 latency histogram buckets are powers of two, in ns
+#define STATS_HIST_BUCKETS      32
+
+typedef struct {
+    unsigned long count[CNT_MAX];
+    lsi_timer_t timer[TIMER_MAX];
+    unsigned long read_hist[STATS_HIST_BUCKETS];
+} lsi_stats_t;
+
+// --json results and phase timeline of the current operation
+#define JSON_MAX_FIELDS         32
+#define JSON_MAX_PHASES         32
+
+typedef struct {
+    uint64_t start;
+    int nfields;
+    struct {
+        const char *key;
+        char val[80];
+    } field[JSON_MAX_FIELDS];
+    int nphases;
+    struct {
+        const char *name;
+        uint64_t start;
+    } phase[JSON_MAX_PHASES];
+} lsi_json_t;
+
+typedef struct {
+    // A PCI ID, or the full emu[-mr][:eeprom.bin] spec
+    char pci_id[64];
 
     void *bar1;
+    int mode;
+
+    // Software device model, used instead of bar1 when set
+    lsi_emu_t *emu;
+    // The HCDW is emulated memory, with no physical address to pin down
+    int plain_mem;
+
+    // VFIO backend state (vfio == 0 means plain sysfs resource access)
+    int vfio;
+    int vfio_container;
+    int vfio_group;
+    int vfio_device;
+    uint64_t vfio_config;
 
     void *hcdw;
+    size_t hcdw_size;
+    size_t hcdw_map_len;
+    uint64_t hcdw_phys;
 
     uint8_t sbr_addr;
     int eep_type;
+    int eep_page;
+
+    // Set while we hold the I2C pins
+    int i2c_open;
+
+    // Host-side copy of CHIP_I2C_PINS with the read-only input bits masked
+    uint32_t i2c_pins;
+
+    // I2C bus timing
+    uint64_t i2c_delay_ns;
+    uint64_t clock_overhead_ns;
+    uint64_t i2c_jitter_max_ns;
+    uint64_t i2c_active_ns;
+    uint64_t i2c_start_ts;
+    unsigned long i2c_bits;
 
     uint32_t r_diag;
     uint32_t r_wrseq;
     uint32_t r_rw_data;
     uint32_t r_rw_addr_low;
     uint32_t r_rw_addr_high;
+
+    // Last values programmed into the diag window / DCR address registers,
+    // so redundant address writes can be skipped.
+    int cache_valid;
+    uint32_t c_rw_addr_high;
+    uint32_t c_rw_addr_low;
+    uint32_t c_dcr_addr;
+    // Diag window auto-increment after a data read/write (0 or 4), or -1
+    // if unknown, in which case the low address is never cached.
+    int rw_rd_step;
+    int rw_wr_step;
+
+    unsigned long mmio_ops;
+    unsigned long mmio_saved;
+
+    // Only allocated with --stats
+    lsi_stats_t *stats;
+    // Only allocated with --json
+    lsi_json_t *json;
+
+    // Leave the I2C bus to us after this operation, for the next one
+    int i2c_keep;
 } lsi_dev_t;
 
-static uint32_t read32(lsi_dev_t *d, uint32_t offset)
+#define CACHE_RW_HIGH   0x01
+#define CACHE_RW_LOW    0x02
+#define CACHE_DCR_ADDR  0x04
+
+enum {
+    REGOP_READ,
+    REGOP_DCR_READ,
+    REGOP_CHIP_READ,
+};
+
+typedef struct {
+    int op;
+    uint32_t addr;
+    uint32_t val;
+} lsi_regop_t;
+
+static uint64_t lsi_now(void)
 {
-    return *(volatile uint32_t *)(d->bar1 + offset);
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static void write32(lsi_dev_t *d, uint32_t offset, uint32_t data)
+/*
+ * Software model of a SAS2008, selected with a PCI ID of "emu" or
+ * "emu:<eeprom image>" ("emu-mr" for MegaRAID mode). It covers what lsirec
+ * touches: the doorbell state, the WRSEQ unlock and DIAG register (reset,
+ * HCB hold and host boot), the DCR and diag RW windows, and a 24Cxx-style
+ * EEPROM hanging off the bit-banged CHIP_I2C_PINS, including page writes
+ * and the write cycle time during which it does not ACK. The EEPROM image
+ * file, if given, is loaded on open and updated on every write cycle.
+ */
+#define EMU_RESET_NS            20000000
+#define EMU_RESET_DEAD_NS       5000000
+#define EMU_BOOT_NS             100000000
+#define EMU_HOSTBOOT_NS         50000000
+#define EMU_WRITE_CYCLE_NS      5000000
+
+enum {
+    EMU_I2C_IDLE,
+    EMU_I2C_ADDR,
+    EMU_I2C_OFFSET_HI,
+    EMU_I2C_OFFSET_LO,
+    EMU_I2C_WRITE,
+    EMU_I2C_READ,
+};
+
+struct lsi_emu {
+    int megaraid;
+    uint32_t r_diag_off;
+    uint32_t r_wrseq_off;
+    uint32_t r_rw_data_off;
+    uint32_t r_rw_low_off;
+    uint32_t r_rw_high_off;
+
+    uint32_t doorbell;
+    uint32_t diag;
+    int wrseq_pos;
+    uint64_t reset_until;
+    uint64_t ready_at;
+
+    uint32_t rw_low;
+    uint32_t rw_high;
+    uint32_t dcr_addr;
+    uint32_t dcr_i2c_select;
+    uint32_t dcr_sbr_config;
+    uint32_t hcdw_size;
+    uint32_t hcdw_low;
+    uint32_t hcdw_high;
+
+    // I2C pins and EEPROM
+    uint32_t pins;
+    int scl;
+    int sda;
+    int slave_sda_low;
+    int state;
+    int clk;
+    int tx;
+    int ack;
+    uint8_t shift;
+    uint8_t *mem;
+    int mem_size;
+    int page;
+    int addr16;
+    uint8_t dev_addr;
+    int ptr;
+    uint8_t *page_buf;
+    uint8_t *page_dirty;
+    int page_base;
+    uint64_t busy_until;
+    int fd;
+};
+
+static const uint8_t emu_wrseq_key[] = { 0x00, 0x04, 0x0b, 0x02, 0x07, 0x0d };
+
+static void emu_update(lsi_emu_t *e)
 {
-    *(volatile uint32_t *)(d->bar1 + offset) = data;
+    uint64_t now = lsi_now();
+
+    if (e->reset_until && now >= e->reset_until) {
+        e->reset_until = 0;
+        e->diag &= ~MPI2_DIAG_RESET_ADAPTER;
+        if (e->diag & MPI2_DIAG_FORCE_HCB)
+            e->diag |= MPI2_DIAG_HOLD_IOC_RESET | MPI2_DIAG_HCB_MODE;
+        else
+            e->ready_at = now + EMU_BOOT_NS;
+    }
+    if (e->ready_at && now >= e->ready_at) {
+        e->ready_at = 0;
+        e->doorbell = MPI2_DOORBELL_READY;
+    }
 }
 
-static uint32_t chip_read32(lsi_dev_t *d, uint32_t offset)
+static void emu_reset(lsi_emu_t *e)
 {
-    write32(d, d->r_rw_addr_high, 0);
-    write32(d, d->r_rw_addr_low, offset);
-    return read32(d, d->r_rw_data);
+    e->doorbell = 0;
+    e->diag &= MPI2_DIAG_FORCE_HCB | MPI2_DIAG_BOOTDEVICE_MASK;
+    e->diag |= MPI2_DIAG_RESET_ADAPTER | MPI2_DIAG_RESET_HISTORY;
+    e->wrseq_pos = 0;
+    e->reset_until = lsi_now() + EMU_RESET_NS;
+    e->ready_at = 0;
+    e->hcdw_size = e->hcdw_low = e->hcdw_high = 0;
+    e->pins = 0;
+    e->scl = e->sda = 1;
+    e->slave_sda_low = 0;
+    e->state = EMU_I2C_IDLE;
 }
 
-static void chip_write32(lsi_dev_t *d, uint32_t offset, uint32_t data)
+static void emu_write_diag(lsi_emu_t *e, uint32_t val)
 {
-    write32(d, d->r_rw_addr_high, 0);
-    write32(d, d->r_rw_addr_low, offset);
-    write32(d, d->r_rw_data, data);
+    uint32_t old = e->diag;
+
+    if (!(e->diag & MPI2_DIAG_WRITE_ENABLE))
+        return;
+
+    if (val & MPI2_DIAG_RESET_ADAPTER) {
+        e->diag = (e->diag & ~MPI2_DIAG_FORCE_HCB) |
+                  (val & MPI2_DIAG_FORCE_HCB);
+        e->diag = (e->diag & ~MPI2_DIAG_BOOTDEVICE_MASK) |
+                  (val & MPI2_DIAG_BOOTDEVICE_MASK);
+        emu_reset(e);
+        return;
+    }
+
+    if (val & MPI2_DIAG_CLR_FLASH_BAD_SIG)
+        val &= ~MPI2_DIAG_FLASH_BAD_SIG;
+    e->diag = (val & ~(MPI2_DIAG_CLR_FLASH_BAD_SIG | MPI2_DIAG_HCB_MODE)) |
+              (old & MPI2_DIAG_HCB_MODE) | MPI2_DIAG_WRITE_ENABLE;
+
+    // Releasing the IOC from reset boots it, from the HCDW if requested
+    if ((old & MPI2_DIAG_HOLD_IOC_RESET) && !(val & MPI2_DIAG_HOLD_IOC_RESET)) {
+        if ((val & MPI2_DIAG_BOOTDEVICE_MASK) == MPI2_DIAG_BOOTDEVICE_HCDW &&
+            !(e->hcdw_size & MPI2_HCDW_SIZE_HCB_ENABLE))
+            e->doorbell = MPI2_DOORBELL_FAULT | 0x0bad;
+        else
+            e->ready_at = lsi_now() + EMU_HOSTBOOT_NS;
+    }
 }
 
-static uint32_t dcr_read32(lsi_dev_t *d, uint32_t offset)
+static void emu_write_wrseq(lsi_emu_t *e, uint32_t val)
 {
-    write32(d, MPI2_DCR_ADDRESS, offset);
-    return read32(d, MPI2_DCR_DATA);
+    if (val == emu_wrseq_key[e->wrseq_pos])
+        e->wrseq_pos++;
+    else
+        e->wrseq_pos = val == emu_wrseq_key[0];
+
+    if (e->wrseq_pos == sizeof(emu_wrseq_key)) {
+        e->diag |= MPI2_DIAG_WRITE_ENABLE;
+        e->wrseq_pos = 0;
+    }
 }
 
-static void dcr_write32(lsi_dev_t *d, uint32_t offset, uint32_t data)
+static void emu_eeprom_commit(lsi_emu_t *e)
 {
-    write32(d, MPI2_DCR_ADDRESS, offset);
-    write32(d, MPI2_DCR_DATA, data);
+    int dirty = 0;
+
+    for (int i = 0; i < e->page; i++) {
+        if (!e->page_dirty[i])
+            continue;
+        e->mem[e->page_base + i] = e->page_buf[i];
+        e->page_dirty[i] = 0;
+        dirty = 1;
+    }
+    if (!dirty)
+        return;
+
+    e->busy_until = lsi_now() + EMU_WRITE_CYCLE_NS;
+    if (e->fd >= 0 && pwrite(e->fd, e->mem + e->page_base, e->page,
+                             e->page_base) != e->page)
+        perror("emu: write eeprom image");
 }
 
-static void lsi_unlock(lsi_dev_t *d)
+static void emu_i2c_tx_bit(lsi_emu_t *e)
 {
-    write32(d, d->r_wrseq, 0x00);
-    write32(d, d->r_wrseq, 0x04);
-    write32(d, d->r_wrseq, 0x0b);
-    write32(d, d->r_wrseq, 0x02);
-    write32(d, d->r_wrseq, 0x07);
-    write32(d, d->r_wrseq, 0x0d);
+    e->slave_sda_low = !(e->shift & (0x80 >> e->clk));
 }
 
-static int lsi_reopen(lsi_dev_t *d)
+// A byte from the master is complete; decide whether to ACK it
+static int emu_i2c_byte(lsi_emu_t *e)
 {
-    uint32_t val;
-
-    d->r_diag = MPI2_DIAG;
-    d->r_wrseq = MPI2_WRSEQ;
-    d->r_rw_addr_high = MPI2_DIAG_RW_ADDRESS_HIGH;
-    d->r_rw_addr_low = MPI2_DIAG_RW_ADDRESS_LOW;
-    d->r_rw_data = MPI2_DIAG_RW_DATA;
+    uint8_t b = e->shift;
 
-    val = read32(d, d->r_diag);
-    if (val & MPI2_DIAG_WRITE_ENABLE) {
-        write32(d, d->r_diag, val | MPI2_DIAG_RW_ENABLE);
-        printf("Device in MPT mode\n");
+    switch (e->state) {
+    case EMU_I2C_ADDR:
+        if ((b >> 1) != e->dev_addr || lsi_now() < e->busy_until)
+            return 0;
+        if (b & 1) {
+            e->state = EMU_I2C_READ;
+        } else {
+            e->state = e->addr16 ? EMU_I2C_OFFSET_HI : EMU_I2C_OFFSET_LO;
+            e->ptr = 0;
+        }
+        return 1;
+    case EMU_I2C_OFFSET_HI:
+        e->ptr = b << 8;
+        e->state = EMU_I2C_OFFSET_LO;
+        return 1;
+    case EMU_I2C_OFFSET_LO:
+        e->ptr = ((e->ptr & 0xff00) | b) % e->mem_size;
+        e->page_base = e->ptr & ~(e->page - 1);
+        e->state = EMU_I2C_WRITE;
+        return 1;
+    case EMU_I2C_WRITE:
+        e->page_buf[e->ptr - e->page_base] = b;
+        e->page_dirty[e->ptr - e->page_base] = 1;
+        // Page writes wrap around within the page
+        e->ptr = e->page_base + ((e->ptr + 1) & (e->page - 1));
+        return 1;
+    default:
         return 0;
     }
+}
 
-    if (read32(d, MR_DIAG) & MPI2_DIAG_WRITE_ENABLE)
-        goto megaraid;
+static void emu_i2c_scl_rise(lsi_emu_t *e)
+{
+    if (e->state == EMU_I2C_IDLE)
+        return;
+
+    e->clk++;
+    if (e->clk <= 8 && !e->tx)
+        e->shift = (e->shift << 1) | e->sda;
+    else if (e->clk == 9 && e->tx)
+        e->ack = !e->sda;
+}
 
-    printf("Trying unlock in MPT mode...\n");
-    lsi_unlock(d);
+static void emu_i2c_scl_fall(lsi_emu_t *e)
+{
+    if (e->state == EMU_I2C_IDLE)
+        return;
 
-    val = read32(d, d->r_diag);
-    if (val & MPI2_DIAG_WRITE_ENABLE) {
-        write32(d, d->r_diag, val | MPI2_DIAG_RW_ENABLE);
-        printf("Device in MPT mode\n");
-        return 0;
+    if (e->clk < 8) {
+        if (e->tx)
+            emu_i2c_tx_bit(e);
+        return;
     }
 
-megaraid:
-    d->r_diag = MR_DIAG;
-    d->r_wrseq = MR_WRSEQ;
-    d->r_rw_addr_high = MR_DIAG_RW_ADDRESS_HIGH;
-    d->r_rw_addr_low = MR_DIAG_RW_ADDRESS_LOW;
-    d->r_rw_data = MR_DIAG_RW_DATA;
+    if (e->clk == 8) {
+        if (e->tx) {
+            e->slave_sda_low = 0;
+        } else {
+            e->ack = emu_i2c_byte(e);
+            e->slave_sda_low = e->ack;
+            if (!e->ack)
+                e->state = EMU_I2C_IDLE;
+        }
+        return;
+    }
 
-    val = read32(d, d->r_diag);
-    if (val & MPI2_DIAG_WRITE_ENABLE) {
-        write32(d, d->r_diag, val | MPI2_DIAG_RW_ENABLE);
-        printf("Device in MEGARAID mode\n");
-        return 0;
+    // End of the ACK clock: set up the next byte
+    e->clk = 0;
+    e->slave_sda_low = 0;
+    if (e->state != EMU_I2C_READ) {
+        e->tx = 0;
+        return;
+    }
+    if (e->tx && !e->ack) {
+        e->state = EMU_I2C_IDLE;
+        e->tx = 0;
+        return;
     }
+    if (e->tx)
+        e->ptr = (e->ptr + 1) % e->mem_size;
+    e->tx = 1;
+    e->shift = e->mem[e->ptr];
+    emu_i2c_tx_bit(e);
+}
 
-    printf("Trying unlock in MEGARAID mode...\n");
-    lsi_unlock(d);
+static void emu_write_pins(lsi_emu_t *e, uint32_t val)
+{
+    int scl, sda, old_scl = e->scl, old_sda = e->sda;
+
+    e->pins = val & (CHIP_I2C_SCL_DRV | CHIP_I2C_SDA_DRV);
+
+    scl = !(e->pins & CHIP_I2C_SCL_DRV);
+    sda = !(e->pins & CHIP_I2C_SDA_DRV) && !e->slave_sda_low;
+    e->scl = scl;
+    e->sda = sda;
+
+    if (scl && old_scl && sda != old_sda) {
+        if (!sda) {
+            // START (or repeated START): pending page data is dropped
+            memset(e->page_dirty, 0, e->page);
+            e->state = EMU_I2C_ADDR;
+        } else {
+            if (e->state == EMU_I2C_WRITE)
+                emu_eeprom_commit(e);
+            e->state = EMU_I2C_IDLE;
+        }
+        e->clk = 0;
+        e->tx = 0;
+        e->slave_sda_low = 0;
+    } else if (scl && !old_scl) {
+        emu_i2c_scl_rise(e);
+    } else if (!scl && old_scl) {
+        emu_i2c_scl_fall(e);
+    }
 
-    val = read32(d, d->r_diag);
-    if (val & MPI2_DIAG_WRITE_ENABLE) {
-        write32(d, d->r_diag, val | MPI2_DIAG_RW_ENABLE);
-        printf("Device in MEGARAID mode\n");
+    e->sda = !(e->pins & CHIP_I2C_SDA_DRV) && !e->slave_sda_low;
+}
+
+static uint32_t emu_chip_read(lsi_emu_t *e, uint32_t addr)
+{
+    switch (addr) {
+    case CHIP_I2C_PINS:
+        return e->pins | (e->scl ? CHIP_I2C_SCL_RD : 0) |
+               (e->sda ? CHIP_I2C_SDA_RD : 0);
+    case CHIP_I2C_RESET:
         return 0;
+    default:
+        // Unmodelled chip memory reads back a recognizable pattern
+        return addr ^ 0x5a5a5a5a;
     }
+}
 
-    fprintf(stderr, "Failed to unlock device\n");
-
-    return -1;
+static void emu_chip_write(lsi_emu_t *e, uint32_t addr, uint32_t val)
+{
+    switch (addr) {
+    case CHIP_I2C_PINS:
+        emu_write_pins(e, val);
+        break;
+    case CHIP_I2C_RESET:
+        if (val & 1) {
+            e->slave_sda_low = 0;
+            e->state = EMU_I2C_IDLE;
+            emu_write_pins(e, 0);
+        }
+        break;
+    }
 }
 
-static int lsi_open(const char *pci_id, lsi_dev_t *d)
+/*
+ * The register entry points are kept out of line and cold, so the only
+ * emulator code on the hardware path is one not-taken branch in read32 and
+ * write32.
+ */
+static uint32_t __attribute__((noinline, cold))
+emu_read32(lsi_emu_t *e, uint32_t offset)
 {
-    char path[128];
+    uint32_t val;
 
-    memset(d, 0, sizeof(*d));
+    emu_update(e);
+
+    if (e->reset_until && lsi_now() + EMU_RESET_NS - EMU_RESET_DEAD_NS <
+        e->reset_until)
+        return 0xffffffff;
+
+    if (offset == MPI2_DOORBELL)
+        return e->doorbell;
+    if (offset == e->r_diag_off)
+        return e->diag;
+    if (offset == e->r_rw_low_off)
+        return e->rw_low;
+    if (offset == e->r_rw_high_off)
+        return e->rw_high;
+    if (offset == e->r_rw_data_off) {
+        if (!(e->diag & MPI2_DIAG_RW_ENABLE))
+            return 0;
+        val = e->rw_high ? 0 : emu_chip_read(e, e->rw_low);
+        e->rw_low += 4;
+        return val;
+    }
 
-    if (strlen(pci_id) > 15)
-        return -1;
+    switch (offset) {
+    case MPI2_DCR_ADDRESS:
+        return e->dcr_addr;
+    case MPI2_DCR_DATA:
+        if (e->dcr_addr == DCR_I2C_SELECT)
+            return e->dcr_i2c_select;
+        if (e->dcr_addr == DCR_SBR_CONFIG)
+            return e->dcr_sbr_config;
+        return 0;
+    case MPI2_HCDW_SIZE:
+        return e->hcdw_size;
+    case MPI2_HCDW_ADDR_LOW:
+        return e->hcdw_low;
+    case MPI2_HCDW_ADDR_HIGH:
+        return e->hcdw_high;
+    }
 
-    strcpy(d->pci_id, pci_id);
+    return 0;
+}
 
-    sprintf(path, "/sys/bus/pci/devices/%s/resource1", pci_id);
+static void __attribute__((noinline, cold))
+emu_write32(lsi_emu_t *e, uint32_t offset, uint32_t val)
+{
+    emu_update(e);
+
+    if (e->reset_until)
+        return;
+
+    if (offset == e->r_wrseq_off) {
+        emu_write_wrseq(e, val);
+    } else if (offset == e->r_diag_off) {
+        emu_write_diag(e, val);
+    } else if (offset == e->r_rw_low_off) {
+        e->rw_low = val;
+    } else if (offset == e->r_rw_high_off) {
+        e->rw_high = val;
+    } else if (offset == e->r_rw_data_off) {
+        if (!(e->diag & MPI2_DIAG_RW_ENABLE))
+            return;
+        if (!e->rw_high)
+            emu_chip_write(e, e->rw_low, val);
+        e->rw_low += 4;
+    } else if (offset == MPI2_DCR_ADDRESS) {
+        e->dcr_addr = val;
+    } else if (offset == MPI2_DCR_DATA) {
+        if (e->dcr_addr == DCR_I2C_SELECT)
+            e->dcr_i2c_select = val;
+    } else if (offset == MPI2_HCDW_SIZE) {
+        e->hcdw_size = val;
+    } else if (offset == MPI2_HCDW_ADDR_LOW) {
+        e->hcdw_low = val;
+    } else if (offset == MPI2_HCDW_ADDR_HIGH) {
+        e->hcdw_high = val;
+    }
+}
 
-    int fd = open(path, O_RDWR);
-    if (fd < 0) {
-        perror("open bar1");
-        return fd;
+static lsi_emu_t *emu_open(const char *spec)
+{
+    lsi_emu_t *e = calloc(1, sizeof(*e));
+    const char *image = strchr(spec, ':');
+
+    e->megaraid = !strncmp(spec, "emu-mr", 6);
+    if (e->megaraid) {
+        e->r_diag_off = MR_DIAG;
+        e->r_wrseq_off = MR_WRSEQ;
+        e->r_rw_data_off = MR_DIAG_RW_DATA;
+        e->r_rw_low_off = MR_DIAG_RW_ADDRESS_LOW;
+        e->r_rw_high_off = MR_DIAG_RW_ADDRESS_HIGH;
+    } else {
+        e->r_diag_off = MPI2_DIAG;
+        e->r_wrseq_off = MPI2_WRSEQ;
+        e->r_rw_data_off = MPI2_DIAG_RW_DATA;
+        e->r_rw_low_off = MPI2_DIAG_RW_ADDRESS_LOW;
+        e->r_rw_high_off = MPI2_DIAG_RW_ADDRESS_HIGH;
     }
 
-    d->bar1 = mmap(NULL, 0x1000, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    e->doorbell = MPI2_DOORBELL_OPERATIONAL;
+    e->scl = e->sda = 1;
+    e->dev_addr = 0x50;
+    e->mem_size = SBR_SIZE;
+    e->fd = -1;
 
-    if (d->bar1 == MAP_FAILED) {
-        perror("mmap bar1");
-        return -1;
+    if (image) {
+        struct stat st;
+
+        e->fd = open(image + 1, O_RDWR | O_CREAT, 0666);
+        if (e->fd < 0 || fstat(e->fd, &st) < 0) {
+            perror("emu: open eeprom image");
+            free(e);
+            return NULL;
+        }
+        if (st.st_size > SBR_SIZE) {
+            e->mem_size = 1;
+            while (e->mem_size < st.st_size && e->mem_size < 0x10000)
+                e->mem_size <<= 1;
+        }
     }
 
-    close(fd);
+    // Anything past 2KB needs 16-bit offsets
+    e->addr16 = e->mem_size > 0x800;
+    e->page = e->addr16 ? EEPROM_PAGE_16BIT : EEPROM_PAGE_8BIT;
+    if (e->addr16)
+        e->dcr_sbr_config |= 8;
 
-    return lsi_reopen(d);
+    e->mem = malloc(e->mem_size);
+    e->page_buf = calloc(1, e->page);
+    e->page_dirty = calloc(1, e->page);
+    memset(e->mem, 0xff, e->mem_size);
+    if (e->fd >= 0 && pread(e->fd, e->mem, e->mem_size, 0) < 0)
+        perror("emu: read eeprom image");
+
+    return e;
 }
 
-static int lsi_setup_hcdw(lsi_dev_t *d)
+static void emu_close(lsi_emu_t *e)
 {
-    char path[128];
-    int fd;
-
-    printf("Setting up HCB...\n");
-
-    // Enable bus mastering
-    sprintf(path, "/sys/bus/pci/devices/%s/config", d->pci_id);
+    if (e->fd >= 0)
+        close(e->fd);
+    free(e->mem);
+    free(e->page_buf);
+    free(e->page_dirty);
+    free(e);
+}
 
-    fd = open(path, O_RDWR);
-    if (fd < 0) {
-        perror("open config");
-        return fd;
-    }
-    if (lseek(fd, 4, SEEK_SET) < 0) {
-        perror("lseek cmd");
-        return -1;
-    }
-    uint16_t cmd;
-    if (read(fd, &cmd, 2) != 2) {
-        perror("read cmd");
-        return -1;
-    }
-    cmd |= 0x4; // bus master
-    if (lseek(fd, 4, SEEK_SET) < 0) {
-        perror("lseek cmd");
-        return -1;
-    }
-    if (write(fd, &cmd, 2) != 2) {
-        perror("write cmd");
-        return -1;
-    }
-    close(fd);
+static const char *stats_cnt_names[CNT_MAX] = {
+    [CNT_READ32] = "read32",
+    [CNT_WRITE32] = "write32",
+    [CNT_CHIP_READ] = "chip_read32",
+    [CNT_CHIP_WRITE] = "chip_write32",
+    [CNT_DCR_READ] = "dcr_read32",
+    [CNT_DCR_WRITE] = "dcr_write32",
+    [CNT_IOC_POLL] = "ioc_polls",
+};
+
+static const char *stats_timer_names[TIMER_MAX] = {
+    [TIMER_I2C_START] = "i2c_start",
+    [TIMER_I2C_STOP] = "i2c_stop",
+    [TIMER_I2C_BIT] = "i2c_bit",
+    [TIMER_I2C_BYTE] = "i2c_byte",
+    [TIMER_I2C_DELAY] = "i2c_delay",
+};
+
+static inline void stat_count(lsi_dev_t *d, int cnt)
+{
+    if (d->stats)
+        d->stats->count[cnt]++;
+}
 
-    d->hcdw = mmap(NULL, HCDW_SIZE, PROT_READ|PROT_WRITE,
-                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_LOCKED, 0, 0);
+static inline uint64_t stat_begin(lsi_dev_t *d)
+{
+    return d->stats ? lsi_now() : 0;
+}
 
-    if (d->hcdw == MAP_FAILED) {
-        perror("mmap hcdw");
-        fprintf(stderr, "Do you have hugepages enabled?\n");
-        fprintf(stderr, "Try: echo 16 > /proc/sys/vm/nr_hugepages\n");
-        return -1;
-    }
+static inline void stat_end(lsi_dev_t *d, int timer, uint64_t t0)
+{
+    if (!d->stats)
+        return;
 
-    printf("HCDW virtual: %p\n", d->hcdw);
+    lsi_timer_t *t = &d->stats->timer[timer];
+    uint64_t ns = lsi_now() - t0;
 
-    fd = open("/proc/self/pagemap", O_RDONLY);
-    if (fd < 0) {
-        perror("open /proc/self/pagemap");
-        return fd;
-    }
-    if (lseek(fd, ((uintptr_t)d->hcdw) >> (PAGE_SHIFT - 3), SEEK_SET) < 0) {
-        perror("lseek /proc/self/pagemap");
-        return -1;
-    }
-    uint64_t phys;
-    if (read(fd, &phys, 8) != 8) {
-        perror("read /proc/self/pagemap");
-        return -1;
-    }
-    close(fd);
+    t->count++;
+    t->total_ns += ns;
+    if (ns > t->max_ns)
+        t->max_ns = ns;
+}
 
-    phys = (phys & ((1ULL<<55) - 1)) << PAGE_SHIFT;
+static void stat_read_latency(lsi_dev_t *d, uint64_t t0)
+{
+    uint64_t ns = lsi_now() - t0;
+    int bucket = 0;
 
-    printf("HCDW physical: 0x%lx\n", phys);
+    while (bucket < STATS_HIST_BUCKETS - 1 && (1ULL << bucket) < ns)
+        bucket++;
+    d->stats->read_hist[bucket]++;
+}
 
-    write32(d, MPI2_HCDW_ADDR_LOW, phys & 0xffffffff);
-    write32(d, MPI2_HCDW_ADDR_HIGH, phys >> 32);
-    write32(d, MPI2_HCDW_SIZE, (0xfffff000 & ~(HCDW_SIZE-1)) | 1);
+/*
+ * Mark the start of a phase of the current operation. Each phase lasts until
+ * the next one starts or the operation ends.
+ */
+static void lsi_phase(lsi_dev_t *d, const char *name)
+{
+    lsi_json_t *j = d->json;
 
-    return 0;
+    if (!j || j->nphases >= JSON_MAX_PHASES)
+        return;
+    j->phase[j->nphases].name = name;
+    j->phase[j->nphases].start = lsi_now();
+    j->nphases++;
 }
 
-static int lsi_disable_hcdw(lsi_dev_t *d)
+// Quote and escape a string for a JSON value; truncates to fit buf
+static const char *lsi_json_escape(char *buf, size_t len, const char *str)
 {
-    write32(d, MPI2_HCDW_SIZE, 0);
-    write32(d, MPI2_HCDW_ADDR_LOW, 0);
-    write32(d, MPI2_HCDW_ADDR_HIGH, 0);
-
-    int ret = munmap(d->hcdw, HCDW_SIZE);
-    if (ret < 0) {
-        perror("munmap hcdw");
-        return ret;
+    size_t n = 0;
+
+    buf[n++] = '"';
+    for (; *str && n + 8 < len; str++) {
+        unsigned char c = *str;
+
+        if (c == '"' || c == '\\')
+            n += snprintf(buf + n, len - n, "\\%c", c);
+        else if (c < 0x20 || c >= 0x7f)
+            n += snprintf(buf + n, len - n, "\\u%04x", c);
+        else
+            buf[n++] = c;
     }
-
-    return 0;
+    buf[n++] = '"';
+    buf[n] = 0;
+    return buf;
 }
 
-static int lsi_unbind_driver(lsi_dev_t *d)
+// Set a result field to a raw JSON value, replacing any earlier one
+static void lsi_json_raw(lsi_dev_t *d, const char *key, const char *val)
 {
-    char path[128];
-    int ret;
+    lsi_json_t *j = d->json;
+    int i;
 
-    sprintf(path, "/sys/bus/pci/devices/%s/driver/unbind", d->pci_id);
+    if (!j)
+        return;
+    for (i = 0; i < j->nfields; i++)
+        if (!strcmp(j->field[i].key, key))
+            break;
+    if (i == JSON_MAX_FIELDS)
+        return;
+    if (i == j->nfields)
+        j->nfields++;
+    j->field[i].key = key;
+    snprintf(j->field[i].val, sizeof(j->field[i].val), "%s", val);
+}
 
-    int fd = open(path, O_WRONLY|O_TRUNC);
-    if (fd < 0) {
-        if (errno == ENOENT)
-            return 0;
-        perror("open unbind");
-        return fd;
-    }
+static void lsi_json_str(lsi_dev_t *d, const char *key, const char *str)
+{
+    char buf[80];
 
-    ret = write(fd, d->pci_id, strlen(d->pci_id));
-    if (ret != strlen(d->pci_id)) {
-        perror("write unbind");
-        close(fd);
-        return ret;
-    }
+    if (!d->json)
+        return;
+    lsi_json_raw(d, key, lsi_json_escape(buf, sizeof(buf), str));
+}
 
-    printf("Kernel driver unbound from device\n");
+static void lsi_json_num(lsi_dev_t *d, const char *key, double val)
+{
+    char buf[32];
 
-    close(fd);
-    return 1;
+    if (!d->json)
+        return;
+    snprintf(buf, sizeof(buf), "%.15g", val);
+    lsi_json_raw(d, key, buf);
 }
 
-static int lsi_rescan(lsi_dev_t *d)
+// Register values, as "0x%08x" strings
+static void lsi_json_hex(lsi_dev_t *d, const char *key, uint32_t val)
 {
-    char path[128];
-    int ret;
+    char buf[16];
 
-    printf("Removing PCI device...\n");
+    if (!d->json)
+        return;
+    snprintf(buf, sizeof(buf), "\"0x%08x\"", val);
+    lsi_json_raw(d, key, buf);
+}
 
-    sprintf(path, "/sys/bus/pci/devices/%s/remove", d->pci_id);
+static uint32_t read32(lsi_dev_t *d, uint32_t offset)
+{
+    uint64_t t0 = stat_begin(d);
+    uint32_t val;
 
-    int fd = open(path, O_WRONLY|O_TRUNC);
-    if (fd < 0) {
+    d->mmio_ops++;
+    if (__builtin_expect(d->emu != NULL, 0))
+        val = emu_read32(d->emu, offset);
+    else
+        val = *(volatile uint32_t *)(d->bar1 + offset);
+
+    if (d->stats) {
+        d->stats->count[CNT_READ32]++;
+        stat_read_latency(d, t0);
+    }
+    return val;
+}
+
+static void write32(lsi_dev_t *d, uint32_t offset, uint32_t data)
+{
+    d->mmio_ops++;
+    stat_count(d, CNT_WRITE32);
+    if (__builtin_expect(d->emu != NULL, 0)) {
+        emu_write32(d->emu, offset, data);
+        return;
+    }
+    *(volatile uint32_t *)(d->bar1 + offset) = data;
+}
+
+static void lsi_invalidate_cache(lsi_dev_t *d)
+{
+    d->cache_valid = 0;
+}
+
+static void chip_set_addr(lsi_dev_t *d, uint32_t high, uint32_t low)
+{
+    if ((d->cache_valid & CACHE_RW_HIGH) && d->c_rw_addr_high == high) {
+        d->mmio_saved++;
+    } else {
+        write32(d, d->r_rw_addr_high, high);
+        d->c_rw_addr_high = high;
+        d->cache_valid |= CACHE_RW_HIGH;
+    }
+
+    if ((d->cache_valid & CACHE_RW_LOW) && d->c_rw_addr_low == low) {
+        d->mmio_saved++;
+    } else {
+        write32(d, d->r_rw_addr_low, low);
+        d->c_rw_addr_low = low;
+        d->cache_valid |= CACHE_RW_LOW;
+    }
+}
+
+static void chip_advance(lsi_dev_t *d, int step)
+{
+    if (step < 0)
+        d->cache_valid &= ~CACHE_RW_LOW;
+    else
+        d->c_rw_addr_low += step;
+}
+
+static uint32_t chip_read32(lsi_dev_t *d, uint32_t offset)
+{
+    stat_count(d, CNT_CHIP_READ);
+    chip_set_addr(d, 0, offset);
+    uint32_t val = read32(d, d->r_rw_data);
+    chip_advance(d, d->rw_rd_step);
+    return val;
+}
+
+static void chip_write32(lsi_dev_t *d, uint32_t offset, uint32_t data)
+{
+    stat_count(d, CNT_CHIP_WRITE);
+    chip_set_addr(d, 0, offset);
+    write32(d, d->r_rw_data, data);
+    chip_advance(d, d->rw_wr_step);
+}
+
+// Any chip address, for peek/poke/dump
+static uint32_t chip_read64(lsi_dev_t *d, uint64_t addr)
+{
+    chip_set_addr(d, addr >> 32, addr);
+    uint32_t val = read32(d, d->r_rw_data);
+    chip_advance(d, d->rw_rd_step);
+    return val;
+}
+
+static void chip_write64(lsi_dev_t *d, uint64_t addr, uint32_t data)
+{
+    chip_set_addr(d, addr >> 32, addr);
+    write32(d, d->r_rw_data, data);
+    chip_advance(d, d->rw_wr_step);
+}
+
+static void dcr_set_addr(lsi_dev_t *d, uint32_t offset)
+{
+    if ((d->cache_valid & CACHE_DCR_ADDR) && d->c_dcr_addr == offset) {
+        d->mmio_saved++;
+        return;
+    }
+    write32(d, MPI2_DCR_ADDRESS, offset);
+    d->c_dcr_addr = offset;
+    d->cache_valid |= CACHE_DCR_ADDR;
+}
+
+static uint32_t dcr_read32(lsi_dev_t *d, uint32_t offset)
+{
+    stat_count(d, CNT_DCR_READ);
+    dcr_set_addr(d, offset);
+    return read32(d, MPI2_DCR_DATA);
+}
+
+static void dcr_write32(lsi_dev_t *d, uint32_t offset, uint32_t data)
+{
+    stat_count(d, CNT_DCR_WRITE);
+    dcr_set_addr(d, offset);
+    write32(d, MPI2_DCR_DATA, data);
+}
+
+/*
+ * Read a list of registers back to back, through whichever window each one
+ * needs. Results are returned in ops[i].val.
+ */
+static void lsi_regops(lsi_dev_t *d, lsi_regop_t *ops, int count)
+{
+    for (int i = 0; i < count; i++) {
+        lsi_regop_t *op = &ops[i];
+        switch (op->op) {
+        case REGOP_READ:
+            op->val = read32(d, op->addr);
+            break;
+        case REGOP_DCR_READ:
+            op->val = dcr_read32(d, op->addr);
+            break;
+        case REGOP_CHIP_READ:
+            op->val = chip_read32(d, op->addr);
+            break;
+        }
+    }
+}
+
+/*
+ * Figure out whether the diag window address auto-increments after a read,
+ * by reading back the low address register. Reading CHIP_I2C_PINS has no side
+ * effects. Until the write step is probed, writes always reload the address.
+ */
+static void lsi_probe_window(lsi_dev_t *d)
+{
+    uint32_t addr;
+
+    lsi_invalidate_cache(d);
+    d->rw_rd_step = -1;
+    d->rw_wr_step = -1;
+
+    write32(d, d->r_rw_addr_high, 0);
+    write32(d, d->r_rw_addr_low, CHIP_I2C_PINS);
+    read32(d, d->r_rw_data);
+    addr = read32(d, d->r_rw_addr_low);
+    if (addr == CHIP_I2C_PINS || addr == CHIP_I2C_PINS + 4)
+        d->rw_rd_step = addr - CHIP_I2C_PINS;
+
+    d->c_rw_addr_high = 0;
+    d->cache_valid |= CACHE_RW_HIGH;
+    if (d->rw_rd_step >= 0) {
+        d->c_rw_addr_low = addr;
+        d->cache_valid |= CACHE_RW_LOW;
+    }
+}
+
+/*
+ * Same for writes. This writes CHIP_I2C_PINS back unchanged, so it is only
+ * done once we own the I2C pins.
+ */
+static void lsi_probe_write_step(lsi_dev_t *d)
+{
+    uint32_t val, addr;
+
+    if (d->rw_wr_step >= 0)
+        return;
+
+    val = chip_read32(d, CHIP_I2C_PINS);
+    write32(d, d->r_rw_addr_low, CHIP_I2C_PINS);
+    write32(d, d->r_rw_data, val);
+    addr = read32(d, d->r_rw_addr_low);
+    if (addr == CHIP_I2C_PINS || addr == CHIP_I2C_PINS + 4)
+        d->rw_wr_step = addr - CHIP_I2C_PINS;
+
+    d->c_rw_addr_low = addr;
+    d->cache_valid |= CACHE_RW_LOW;
+}
+
+static void lsi_print_stats(lsi_dev_t *d)
+{
+    lsi_stats_t *st = d->stats;
+    unsigned long reads = 0, seen = 0;
+    int p50 = -1, p99 = -1;
+
+    printf("Statistics:\n");
+    printf(" MMIO: %lu accesses, %lu elided by address cache\n",
+           d->mmio_ops, d->mmio_saved);
+    for (int i = 0; i < CNT_MAX; i++)
+        printf(" %-14s %lu\n", stats_cnt_names[i], st->count[i]);
+
+    for (int i = 0; i < STATS_HIST_BUCKETS; i++)
+        reads += st->read_hist[i];
+    if (reads) {
+        printf(" read32 latency:\n");
+        for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+            if (!st->read_hist[i])
+                continue;
+            seen += st->read_hist[i];
+            if (p50 < 0 && seen * 2 >= reads)
+                p50 = i;
+            if (p99 < 0 && seen * 100 >= reads * 99)
+                p99 = i;
+            printf("  <= %10llu ns: %lu\n", 1ULL << i, st->read_hist[i]);
+        }
+        printf("  p50 <= %llu ns, p99 <= %llu ns\n", 1ULL << p50, 1ULL << p99);
+    }
+
+    for (int i = 0; i < TIMER_MAX; i++) {
+        lsi_timer_t *t = &st->timer[i];
+        if (!t->count)
+            continue;
+        printf(" %-14s %lu calls, %.3f ms total, %" PRIu64 " ns avg, %" PRIu64
+               " ns max\n",
+               stats_timer_names[i], t->count, t->total_ns / 1e6,
+               t->total_ns / t->count, t->max_ns);
+    }
+}
+
+static void lsi_unlock(lsi_dev_t *d)
+{
+    write32(d, d->r_wrseq, 0x00);
+    write32(d, d->r_wrseq, 0x04);
+    write32(d, d->r_wrseq, 0x0b);
+    write32(d, d->r_wrseq, 0x02);
+    write32(d, d->r_wrseq, 0x07);
+    write32(d, d->r_wrseq, 0x0d);
+}
+
+static int lsi_reopen(lsi_dev_t *d)
+{
+    uint32_t val;
+
+    lsi_invalidate_cache(d);
+
+    d->r_diag = MPI2_DIAG;
+    d->r_wrseq = MPI2_WRSEQ;
+    d->r_rw_addr_high = MPI2_DIAG_RW_ADDRESS_HIGH;
+    d->r_rw_addr_low = MPI2_DIAG_RW_ADDRESS_LOW;
+    d->r_rw_data = MPI2_DIAG_RW_DATA;
+
+    val = read32(d, d->r_diag);
+    if (val & MPI2_DIAG_WRITE_ENABLE)
+        goto mpt;
+
+    if (read32(d, MR_DIAG) & MPI2_DIAG_WRITE_ENABLE)
+        goto megaraid;
+
+    lsi_info("Trying unlock in MPT mode...\n");
+    lsi_unlock(d);
+
+    val = read32(d, d->r_diag);
+    if (val & MPI2_DIAG_WRITE_ENABLE)
+        goto mpt;
+
+megaraid:
+    d->r_diag = MR_DIAG;
+    d->r_wrseq = MR_WRSEQ;
+    d->r_rw_addr_high = MR_DIAG_RW_ADDRESS_HIGH;
+    d->r_rw_addr_low = MR_DIAG_RW_ADDRESS_LOW;
+    d->r_rw_data = MR_DIAG_RW_DATA;
+
+    val = read32(d, d->r_diag);
+    if (val & MPI2_DIAG_WRITE_ENABLE)
+        goto megaraid_ok;
+
+    lsi_info("Trying unlock in MEGARAID mode...\n");
+    lsi_unlock(d);
+
+    val = read32(d, d->r_diag);
+    if (val & MPI2_DIAG_WRITE_ENABLE)
+        goto megaraid_ok;
+
+    fprintf(stderr, "Failed to unlock device\n");
+
+    return -1;
+
+mpt:
+    write32(d, d->r_diag, val | MPI2_DIAG_RW_ENABLE);
+    d->mode = LSI_MODE_MPT;
+    lsi_info("Device in MPT mode\n");
+    lsi_probe_window(d);
+    return 0;
+
+megaraid_ok:
+    write32(d, d->r_diag, val | MPI2_DIAG_RW_ENABLE);
+    d->mode = LSI_MODE_MEGARAID;
+    lsi_info("Device in MEGARAID mode\n");
+    lsi_probe_window(d);
+    return 0;
+}
+
+// HCDW IOVA when using VFIO. Any address aligned to the window size will do,
+// as long as it stays clear of reserved ranges; use the size itself.
+#define VFIO_HCDW_IOVA(size) (size)
+
+static int lsi_sysfs_write(const char *pci_id, const char *attr,
+                           const char *val)
+{
+    char path[128];
+
+    if (pci_id)
+        snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/%s", pci_id, attr);
+    else
+        snprintf(path, sizeof(path), "/sys/bus/pci/%s", attr);
+
+    int fd = open(path, O_WRONLY);
+    if (fd < 0)
+        return -1;
+    int ret = write(fd, val, strlen(val));
+    close(fd);
+
+    return ret == strlen(val) ? 0 : -1;
+}
+
+/*
+ * Hand the device to vfio-pci. Resets are disabled through reset_method,
+ * since vfio-pci would otherwise reset the adapter when we open it and again
+ * when we exit, undoing a host boot.
+ */
+static int lsi_unbind_driver(lsi_dev_t *d);
+
+static int lsi_vfio_bind(lsi_dev_t *d)
+{
+    char path[128], link[256];
+
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/driver", d->pci_id);
+    ssize_t ret = readlink(path, link, sizeof(link) - 1);
+    if (ret > 0) {
+        link[ret] = 0;
+        if (!strcmp(strrchr(link, '/') + 1, "vfio-pci"))
+            goto bound;
+    }
+
+    if (lsi_sysfs_write(d->pci_id, "driver_override", "vfio-pci") < 0) {
+        perror("write driver_override");
+        return -1;
+    }
+    if (lsi_unbind_driver(d) < 0)
+        return -1;
+    if (lsi_sysfs_write(NULL, "drivers_probe", d->pci_id) < 0) {
+        perror("write drivers_probe");
+        return -1;
+    }
+    // vfio-pci stays bound; a later rescan picks the usual driver again
+    if (lsi_sysfs_write(d->pci_id, "driver_override", "\n") < 0)
+        perror("clear driver_override");
+    printf("Device bound to vfio-pci\n");
+
+bound:
+    if (lsi_sysfs_write(d->pci_id, "reset_method", "\n") < 0)
+        fprintf(stderr, "Warning: could not disable resets; vfio-pci may "
+                "reset the adapter on open/close\n");
+    return 0;
+}
+
+static int lsi_vfio_open(lsi_dev_t *d)
+{
+    char path[128], link[256];
+    struct vfio_group_status status = { .argsz = sizeof(status) };
+    struct vfio_region_info bar = {
+        .argsz = sizeof(bar),
+        .index = VFIO_PCI_BAR1_REGION_INDEX,
+    };
+    struct vfio_region_info cfg = {
+        .argsz = sizeof(cfg),
+        .index = VFIO_PCI_CONFIG_REGION_INDEX,
+    };
+
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/iommu_group",
+             d->pci_id);
+    ssize_t ret = readlink(path, link, sizeof(link) - 1);
+    if (ret < 0) {
+        perror("readlink iommu_group");
+        fprintf(stderr, "Is the IOMMU enabled?\n");
+        return -1;
+    }
+    link[ret] = 0;
+
+    if (lsi_vfio_bind(d) < 0)
+        return -1;
+
+    d->vfio_container = open("/dev/vfio/vfio", O_RDWR);
+    if (d->vfio_container < 0) {
+        perror("open /dev/vfio/vfio");
+        return -1;
+    }
+    if (ioctl(d->vfio_container, VFIO_GET_API_VERSION) != VFIO_API_VERSION ||
+        !ioctl(d->vfio_container, VFIO_CHECK_EXTENSION, VFIO_TYPE1_IOMMU)) {
+        fprintf(stderr, "VFIO type 1 IOMMU not supported\n");
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "/dev/vfio/%s", strrchr(link, '/') + 1);
+    d->vfio_group = open(path, O_RDWR);
+    if (d->vfio_group < 0) {
+        perror("open vfio group");
+        return -1;
+    }
+    if (ioctl(d->vfio_group, VFIO_GROUP_GET_STATUS, &status) < 0 ||
+        !(status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
+        fprintf(stderr, "VFIO group %s is not viable; all devices in it must "
+                "be bound to vfio-pci\n", path);
+        return -1;
+    }
+    if (ioctl(d->vfio_group, VFIO_GROUP_SET_CONTAINER, &d->vfio_container) < 0 ||
+        ioctl(d->vfio_container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU) < 0) {
+        perror("vfio set container");
+        return -1;
+    }
+
+    d->vfio_device = ioctl(d->vfio_group, VFIO_GROUP_GET_DEVICE_FD, d->pci_id);
+    if (d->vfio_device < 0) {
+        perror("vfio get device");
+        return -1;
+    }
+
+    if (ioctl(d->vfio_device, VFIO_DEVICE_GET_REGION_INFO, &bar) < 0 ||
+        ioctl(d->vfio_device, VFIO_DEVICE_GET_REGION_INFO, &cfg) < 0) {
+        perror("vfio region info");
+        return -1;
+    }
+    if (!(bar.flags & VFIO_REGION_INFO_FLAG_MMAP)) {
+        fprintf(stderr, "VFIO BAR1 cannot be mmapped\n");
+        return -1;
+    }
+    d->vfio_config = cfg.offset;
+
+    d->bar1 = mmap(NULL, 0x1000, PROT_READ|PROT_WRITE, MAP_SHARED,
+                   d->vfio_device, bar.offset);
+    if (d->bar1 == MAP_FAILED) {
+        perror("mmap bar1");
+        return -1;
+    }
+
+    d->vfio = 1;
+    lsi_info("Using VFIO (IOMMU group %s)\n", strrchr(link, '/') + 1);
+
+    return 0;
+}
+
+static void lsi_vfio_close(lsi_dev_t *d)
+{
+    close(d->vfio_device);
+    close(d->vfio_group);
+    close(d->vfio_container);
+    d->vfio = 0;
+}
+
+static int lsi_vfio_map_hcdw(lsi_dev_t *d)
+{
+    struct vfio_iommu_type1_dma_map map = {
+        .argsz = sizeof(map),
+        .flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE,
+        .vaddr = (uintptr_t)d->hcdw,
+        .iova = VFIO_HCDW_IOVA(d->hcdw_size),
+        .size = d->hcdw_size,
+    };
+
+    if (ioctl(d->vfio_container, VFIO_IOMMU_MAP_DMA, &map) < 0) {
+        perror("VFIO_IOMMU_MAP_DMA");
+        return -1;
+    }
+
+    d->hcdw_phys = map.iova;
+    return 0;
+}
+
+static void lsi_vfio_unmap_hcdw(lsi_dev_t *d)
+{
+    struct vfio_iommu_type1_dma_unmap unmap = {
+        .argsz = sizeof(unmap),
+        .iova = d->hcdw_phys,
+        .size = d->hcdw_size,
+    };
+
+    if (ioctl(d->vfio_container, VFIO_IOMMU_UNMAP_DMA, &unmap) < 0)
+        perror("VFIO_IOMMU_UNMAP_DMA");
+}
+
+static int lsi_open(const char *pci_id, lsi_dev_t *d)
+{
+    char path[128];
+
+    memset(d, 0, sizeof(*d));
+
+    if (opts.stats)
+        d->stats = calloc(1, sizeof(*d->stats));
+    if (opts.json)
+        d->json = calloc(1, sizeof(*d->json));
+
+    if (!strncmp(pci_id, "emu", 3)) {
+        snprintf(d->pci_id, sizeof(d->pci_id), "%s", pci_id);
+        d->emu = emu_open(pci_id);
+        if (!d->emu)
+            return -1;
+        d->plain_mem = 1;
+        return lsi_reopen(d);
+    }
+
+    if (strlen(pci_id) > 15)
+        return -1;
+
+    strcpy(d->pci_id, pci_id);
+
+    if (opts.vfio) {
+        if (lsi_vfio_open(d) < 0)
+            return -1;
+        return lsi_reopen(d);
+    }
+
+    sprintf(path, "/sys/bus/pci/devices/%s/resource1", pci_id);
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror("open bar1");
+        return fd;
+    }
+
+    d->bar1 = mmap(NULL, 0x1000, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (d->bar1 == MAP_FAILED) {
+        perror("mmap bar1");
+        return -1;
+    }
+
+    close(fd);
+
+    return lsi_reopen(d);
+}
+
+static void lsi_close(lsi_dev_t *d)
+{
+    if (d->emu) {
+        emu_close(d->emu);
+        d->emu = NULL;
+        return;
+    }
+    munmap(d->bar1, 0x1000);
+    d->bar1 = NULL;
+    if (d->vfio)
+        lsi_vfio_close(d);
+}
+
+static size_t lsi_hcdw_size(size_t length)
+{
+    size_t size = HCDW_MIN_SIZE;
+
+    while (size < length)
+        size <<= 1;
+    return size;
+}
+
+/*
+ * Check that the whole HCDW is backed by physically contiguous memory
+ * aligned to the window size, and find its physical address. Hugepages are
+ * at least 2MB, so checking every 2MB is enough.
+ */
+static int lsi_check_hcdw(lsi_dev_t *d)
+{
+    uint64_t base = 0;
+    int ret = -1;
+
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    if (fd < 0) {
+        perror("open /proc/self/pagemap");
+        return fd;
+    }
+
+    for (size_t off = 0; off < d->hcdw_size; off += HCDW_MIN_SIZE) {
+        uint64_t ent, phys;
+        off_t pos = ((uintptr_t)d->hcdw + off) >> (PAGE_SHIFT - 3);
+
+        if (pread(fd, &ent, 8, pos) != 8) {
+            perror("read /proc/self/pagemap");
+            goto out;
+        }
+        if (!(ent >> 63) || !(ent & ((1ULL<<55) - 1))) {
+            fprintf(stderr, "HCDW page at +0x%zx not present or PFN hidden\n",
+                    off);
+            goto out;
+        }
+
+        phys = (ent & ((1ULL<<55) - 1)) << PAGE_SHIFT;
+        if (!off) {
+            base = phys;
+            if (base & (d->hcdw_size - 1)) {
+                printf("HCDW at 0x%" PRIx64 " is not aligned to its size\n",
+                       base);
+                goto out;
+            }
+        } else if (phys != base + off) {
+            printf("HCDW is not physically contiguous at +0x%zx\n", off);
+            goto out;
+        }
+    }
+
+    d->hcdw_phys = base;
+    ret = 0;
+
+out:
+    close(fd);
+    return ret;
+}
+
+static int lsi_try_hcdw(lsi_dev_t *d, void *map, size_t map_len,
+                        const char *how)
+{
+    if (map == MAP_FAILED)
+        return -1;
+
+    d->hcdw = map;
+    d->hcdw_map_len = map_len;
+
+    if (lsi_check_hcdw(d) < 0) {
+        munmap(map, map_len);
+        d->hcdw = NULL;
+        return -1;
+    }
+
+    printf("HCDW: %zu KB window using %s\n", d->hcdw_size >> 10, how);
+    return 0;
+}
+
+// Fall back to a file on each mounted hugetlbfs
+static int lsi_try_hugetlbfs(lsi_dev_t *d)
+{
+    char line[512], mnt[256], type[64], path[320];
+    int ret = -1;
+
+    FILE *fp = fopen("/proc/mounts", "r");
+    if (!fp)
+        return -1;
+
+    while (ret < 0 && fgets(line, sizeof(line), fp)) {
+        struct statfs sfs;
+
+        if (sscanf(line, "%*s %255s %63s", mnt, type) != 2 ||
+            strcmp(type, "hugetlbfs") || statfs(mnt, &sfs) < 0)
+            continue;
+
+        size_t page = sfs.f_bsize;
+        size_t map_len = (d->hcdw_size + page - 1) & ~(page - 1);
+
+        snprintf(path, sizeof(path), "%s/lsirec-XXXXXX", mnt);
+        int fd = mkstemp(path);
+        if (fd < 0)
+            continue;
+        unlink(path);
+
+        void *map = MAP_FAILED;
+        if (ftruncate(fd, map_len) == 0)
+            map = mmap(NULL, map_len, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE|MAP_LOCKED, fd, 0);
+        close(fd);
+
+        snprintf(path, sizeof(path), "hugetlbfs at %s", mnt);
+        ret = lsi_try_hcdw(d, map, map_len, path);
+    }
+
+    fclose(fp);
+    return ret;
+}
+
+// Default hugepage size from /proc/meminfo, 2MB if unknown
+static size_t lsi_default_hugepage(void)
+{
+    char line[128];
+    size_t kb = HCDW_MIN_SIZE >> 10;
+
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (!fp)
+        return HCDW_MIN_SIZE;
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1)
+            break;
+    fclose(fp);
+    return kb << 10;
+}
+
+/*
+ * Allocate the HCDW. With share set, the memory stays shared (and at the same
+ * physical address) across fork, so workers can boot from one buffer.
+ */
+static int lsi_map_hcdw(lsi_dev_t *d, size_t length, int share)
+{
+    int type = share ? MAP_SHARED : MAP_PRIVATE;
+    int flags = type|MAP_ANONYMOUS|MAP_HUGETLB|MAP_LOCKED;
+    void *map;
+
+    d->hcdw_size = lsi_hcdw_size(length);
+
+    // Behind the IOMMU (or in the emulator) the buffer only needs to be
+    // contiguous in IOVA space
+    if (d->vfio || d->plain_mem) {
+        map = mmap(NULL, d->hcdw_size, PROT_READ|PROT_WRITE,
+                   type|MAP_ANONYMOUS|MAP_POPULATE, 0, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap hcdw");
+            return -1;
+        }
+        d->hcdw = map;
+        d->hcdw_map_len = d->hcdw_size;
+        d->hcdw_phys = (uintptr_t)map;
+        printf("HCDW: %zu KB window %s\n", d->hcdw_size >> 10,
+               d->vfio ? "for mapping through the IOMMU" : "in emulated memory");
+        goto done;
+    }
+
+    // The default hugepage size first, then the other common sizes. A 1GB
+    // page is always contiguous but is only worth it when 2MB pages are not.
+    size_t page = lsi_default_hugepage();
+    size_t map_len = (d->hcdw_size + page - 1) & ~(page - 1);
+    map = mmap(NULL, map_len, PROT_READ|PROT_WRITE, flags, 0, 0);
+    if (!lsi_try_hcdw(d, map, map_len, "default hugepages"))
+        goto done;
+
+    if (page != HCDW_MIN_SIZE) {
+        map = mmap(NULL, d->hcdw_size, PROT_READ|PROT_WRITE,
+                   flags | MAP_HUGE_2MB, 0, 0);
+        if (!lsi_try_hcdw(d, map, d->hcdw_size, "2MB hugepages"))
+            goto done;
+    }
+
+    if (page != HCDW_MAX_SIZE && d->hcdw_size > HCDW_MIN_SIZE) {
+        map = mmap(NULL, HCDW_MAX_SIZE, PROT_READ|PROT_WRITE,
+                   flags | MAP_HUGE_1GB, 0, 0);
+        if (!lsi_try_hcdw(d, map, HCDW_MAX_SIZE, "a 1GB hugepage"))
+            goto done;
+    }
+
+    if (!lsi_try_hugetlbfs(d))
+        goto done;
+
+    d->hcdw = NULL;
+    fprintf(stderr, "Failed to allocate a contiguous %zu KB HCDW\n",
+            d->hcdw_size >> 10);
+    fprintf(stderr, "Do you have hugepages enabled?\n");
+    fprintf(stderr, "Try: echo 16 > /proc/sys/vm/nr_hugepages\n");
+    if (d->hcdw_size > HCDW_MIN_SIZE)
+        fprintf(stderr, "or reserve a 1GB page with hugepagesz=1G hugepages=1\n");
+    return -1;
+
+done:
+    printf("HCDW virtual: %p\n", d->hcdw);
+    if (!d->vfio)
+        printf("HCDW physical: 0x%" PRIx64 "\n", d->hcdw_phys);
+
+    return 0;
+}
+
+/*
+ * Firmware staged once by the parent for a multi-device hostboot. Workers
+ * inherit the mapping and program the same window into every adapter.
+ */
+static struct {
+    const char *file;
+    size_t length;
+    lsi_dev_t dev;
+} shared_fw;
+
+static int lsi_alloc_hcdw(lsi_dev_t *d, size_t length)
+{
+    if (lsi_map_hcdw(d, length, 0) < 0)
+        return -1;
+
+    if (d->vfio && lsi_vfio_map_hcdw(d) < 0) {
+        munmap(d->hcdw, d->hcdw_map_len);
+        d->hcdw = NULL;
+        return -1;
+    }
+    if (d->vfio)
+        printf("HCDW IOVA: 0x%" PRIx64 "\n", d->hcdw_phys);
+
+    return 0;
+}
+
+static int lsi_check_firmware(lsi_dev_t *d, const uint8_t *img, size_t len);
+
+static int lsi_use_shared_hcdw(lsi_dev_t *d)
+{
+    lsi_phase(d, "firmware_load");
+    d->hcdw = shared_fw.dev.hcdw;
+    d->hcdw_size = shared_fw.dev.hcdw_size;
+    d->hcdw_map_len = shared_fw.dev.hcdw_map_len;
+    d->hcdw_phys = shared_fw.dev.hcdw_phys;
+
+    // Each device has its own container, so map the buffer into each
+    if (d->vfio && lsi_vfio_map_hcdw(d) < 0) {
+        d->hcdw = NULL;
+        return -1;
+    }
+
+    printf("Using shared HCDW at 0x%" PRIx64 "\n", d->hcdw_phys);
+
+    // Cheap next to the reset, and gives each device its own fw_* results
+    lsi_phase(d, "firmware_check");
+    return lsi_check_firmware(d, d->hcdw + d->hcdw_size - shared_fw.length,
+                              shared_fw.length);
+}
+
+static void lsi_free_hcdw(lsi_dev_t *d)
+{
+    if (d->hcdw && d->vfio)
+        lsi_vfio_unmap_hcdw(d);
+    if (d->hcdw)
+        munmap(d->hcdw, d->hcdw_map_len);
+    d->hcdw = NULL;
+}
+
+static int lsi_enable_busmaster(lsi_dev_t *d)
+{
+    char path[128];
+    int fd;
+    off_t off = 4;
+
+    if (d->emu)
+        return 0;
+
+    if (d->vfio) {
+        fd = dup(d->vfio_device);
+        off += d->vfio_config;
+    } else {
+        sprintf(path, "/sys/bus/pci/devices/%s/config", d->pci_id);
+        fd = open(path, O_RDWR);
+    }
+    if (fd < 0) {
+        perror("open config");
+        return fd;
+    }
+    uint16_t cmd;
+    if (pread(fd, &cmd, 2, off) != 2) {
+        perror("read cmd");
+        close(fd);
+        return -1;
+    }
+    cmd |= 0x4; // bus master
+    if (pwrite(fd, &cmd, 2, off) != 2) {
+        perror("write cmd");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    return 0;
+}
+
+static int lsi_setup_hcdw(lsi_dev_t *d)
+{
+    printf("Setting up HCB...\n");
+
+    if (lsi_enable_busmaster(d) < 0)
+        return -1;
+
+    write32(d, MPI2_HCDW_ADDR_LOW, d->hcdw_phys & 0xffffffff);
+    write32(d, MPI2_HCDW_ADDR_HIGH, d->hcdw_phys >> 32);
+    write32(d, MPI2_HCDW_SIZE,
+            (MPI2_HCDW_SIZE_SIZE_MASK & ~(d->hcdw_size - 1)) |
+            MPI2_HCDW_SIZE_HCB_ENABLE);
+
+    return 0;
+}
+
+static int lsi_disable_hcdw(lsi_dev_t *d)
+{
+    write32(d, MPI2_HCDW_SIZE, 0);
+    write32(d, MPI2_HCDW_ADDR_LOW, 0);
+    write32(d, MPI2_HCDW_ADDR_HIGH, 0);
+
+    if (d->vfio)
+        lsi_vfio_unmap_hcdw(d);
+
+    int ret = munmap(d->hcdw, d->hcdw_map_len);
+    d->hcdw = NULL;
+    if (ret < 0) {
+        perror("munmap hcdw");
+        return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * The IOC boots from the end of the HCDW, so read the image straight to its
+ * final offset and only fill the unused head.
+ */
+static int lsi_load_firmware(lsi_dev_t *d, int fd, size_t length)
+{
+    uint8_t *dst = d->hcdw + d->hcdw_size - length;
+    size_t done = 0;
+
+    memset(d->hcdw, 0x42, d->hcdw_size - length);
+
+    while (done < length) {
+        ssize_t ret = pread(fd, dst + done, length - done, done);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("read firmware");
+            return -1;
+        }
+        if (ret == 0) {
+            fprintf(stderr, "Firmware file truncated at %zu of %zu bytes\n",
+                    done, length);
+            return -1;
+        }
+        done += ret;
+    }
+
+    return 0;
+}
+
+static int lsi_unbind_driver(lsi_dev_t *d)
+{
+    char path[128];
+    int ret;
+
+    // Already bound to vfio-pci, which we hold open
+    if (d->vfio)
+        return 0;
+
+    lsi_phase(d, "unbind");
+    sprintf(path, "/sys/bus/pci/devices/%s/driver/unbind", d->pci_id);
+
+    int fd = open(path, O_WRONLY|O_TRUNC);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        perror("open unbind");
+        return fd;
+    }
+
+    ret = write(fd, d->pci_id, strlen(d->pci_id));
+    if (ret != strlen(d->pci_id)) {
+        perror("write unbind");
+        close(fd);
+        return ret;
+    }
+
+    printf("Kernel driver unbound from device\n");
+
+    close(fd);
+    return 1;
+}
+
+static int lsi_rescan(lsi_dev_t *d)
+{
+    char path[128];
+    int ret;
+
+    printf("Removing PCI device...\n");
+    lsi_phase(d, "remove");
+
+    sprintf(path, "/sys/bus/pci/devices/%s/remove", d->pci_id);
+
+    int fd = open(path, O_WRONLY|O_TRUNC);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        perror("open remove");
+        return fd;
+    }
+
+    ret = write(fd, "1", 1);
+    if (ret != 1) {
+        perror("write remove");
+        close(fd);
+        return ret;
+    }
+
+    close(fd);
+
+    printf("Rescanning PCI bus...\n");
+    lsi_phase(d, "rescan");
+
+    fd = open("/sys/bus/pci/rescan", O_WRONLY|O_TRUNC);
+    if (fd < 0) {
         if (errno == ENOENT)
             return 0;
-        perror("open remove");
+        perror("open rescan");
+        return fd;
+    }
+
+    ret = write(fd, "1", 1);
+    if (ret != 1) {
+        perror("write rescan");
+        close(fd);
+        return ret;
+    }
+
+    close(fd);
+
+    printf("PCI bus rescan complete.\n");
+
+    return 0;
+}
+
+// Unaligned loads are fine; the image sits at an arbitrary HCDW offset
+typedef uint32_t lsi_v4u32 __attribute__((vector_size(16), aligned(4)));
+
+/*
+ * 32-bit word sum of the image, which is zero for a valid one. Four vector
+ * accumulators keep the adds independent so this runs at memory speed.
+ */
+static uint32_t fw_checksum(const uint8_t *img, size_t len)
+{
+    const lsi_v4u32 *v = (const lsi_v4u32 *)img;
+    lsi_v4u32 acc0 = {0}, acc1 = {0}, acc2 = {0}, acc3 = {0};
+    size_t blocks = len / 64;
+    uint32_t sum = 0;
+
+    for (size_t i = 0; i < blocks; i++, v += 4) {
+        acc0 += v[0];
+        acc1 += v[1];
+        acc2 += v[2];
+        acc3 += v[3];
+    }
+    acc0 += acc1 + acc2 + acc3;
+    for (int i = 0; i < 4; i++)
+        sum += acc0[i];
+
+    for (size_t off = blocks * 64; off + 4 <= len; off += 4) {
+        uint32_t word;
+        memcpy(&word, img + off, 4);
+        sum += word;
+    }
+    return sum;
+}
+
+static uint32_t fw_read32(const uint8_t *img, int off)
+{
+    uint32_t val;
+
+    memcpy(&val, img + off, 4);
+    return val;
+}
+
+/*
+ * Sanity check a firmware image before taking the adapter down for it:
+ * header signatures, SAS2 product family, image size and checksum.
+ */
+static int lsi_check_firmware(lsi_dev_t *d, const uint8_t *img, size_t len)
+{
+    const char *err = NULL;
+    uint64_t start = lsi_now();
+    uint16_t vid = 0, pid = 0;
+    uint32_t size = 0;
+
+    if (len < MPI2_FW_HEADER_SIZE) {
+        err = "too short for a firmware header";
+        goto out;
+    }
+
+    if ((fw_read32(img, MPI2_FW_SIGNATURE) & MPI2_FW_SIGNATURE_MASK) !=
+            MPI2_FW_SIGNATURE_VALUE ||
+        fw_read32(img, MPI2_FW_SIGNATURE0) != MPI2_FW_SIGNATURE0_VALUE ||
+        fw_read32(img, MPI2_FW_SIGNATURE1) != MPI2_FW_SIGNATURE1_VALUE ||
+        fw_read32(img, MPI2_FW_SIGNATURE2) != MPI2_FW_SIGNATURE2_VALUE) {
+        err = "bad header signature (not an MPI2 firmware image)";
+        goto out;
+    }
+
+    memcpy(&vid, img + MPI2_FW_VENDOR_ID, 2);
+    memcpy(&pid, img + MPI2_FW_PRODUCT_ID, 2);
+    size = fw_read32(img, MPI2_FW_IMAGE_SIZE);
+    printf("Firmware: vendor 0x%04x, product 0x%04x, %u bytes\n",
+           vid, pid, size);
+    lsi_json_hex(d, "fw_product", pid);
+    lsi_json_num(d, "fw_size", size);
+
+    if ((pid & MPI2_FW_PID_TYPE_MASK) != MPI2_FW_PID_TYPE_SAS ||
+        (pid & MPI2_FW_PID_FAMILY_MASK) != MPI2_FW_PID_FAMILY_SAS2) {
+        err = "not a SAS2008/2108 firmware image";
+        goto out;
+    }
+    if (size > len) {
+        err = "file is shorter than the image size (truncated?)";
+        goto out;
+    }
+    if (size < MPI2_FW_HEADER_SIZE || (size & 3)) {
+        err = "bad image size";
+        goto out;
+    }
+    if (fw_checksum(img, size)) {
+        err = "bad checksum (corrupted image)";
+        goto out;
+    }
+    if (size < len)
+        printf("Note: %zu bytes past the image size are loaded but not "
+               "checked\n", len - size);
+
+out:
+    if (err) {
+        fprintf(stderr, "Firmware rejected: %s%s\n", err,
+                opts.force ? " (ignored with --force)" : "");
+        return opts.force ? 0 : -1;
+    }
+    printf("Firmware checksum OK (%.2f ms)\n", (lsi_now() - start) / 1e6);
+    return 0;
+}
+
+/*
+ * Each bit takes three i2c_delay() periods, with SCL high for one of them and
+ * low for two. Pick the delay from the target bus speed, but never go below
+ * the minimum tHIGH/tLOW for the corresponding I2C speed mode.
+ */
+static void i2c_setup_timing(lsi_dev_t *d, int speed)
+{
+    uint64_t delay, t_high, t_low;
+
+    if (speed <= 100000) {
+        t_high = 4000;
+        t_low = 4700;
+    } else if (speed <= 400000) {
+        t_high = 600;
+        t_low = 1300;
+    } else {
+        t_high = 260;
+        t_low = 500;
+    }
+
+    delay = (1000000000ULL + 3 * speed - 1) / (3 * speed);
+    if (delay < t_high)
+        delay = t_high;
+    if (delay < (t_low + 1) / 2)
+        delay = (t_low + 1) / 2;
+
+    // Calibrate the cost of reading the clock, so the spin loop can account
+    // for it.
+    uint64_t best = ~0ULL;
+    for (int i = 0; i < 64; i++) {
+        uint64_t t0 = lsi_now();
+        uint64_t t1 = lsi_now();
+        if (t1 - t0 < best)
+            best = t1 - t0;
+    }
+
+    d->i2c_delay_ns = delay;
+    d->clock_overhead_ns = best;
+    d->i2c_jitter_max_ns = 0;
+    d->i2c_active_ns = 0;
+    d->i2c_bits = 0;
+
+    printf("Using I2C bus speed %d Hz (%" PRIu64 " ns delay, %" PRIu64
+           " ns clock overhead)\n",
+           speed, delay, best);
+}
+
+static void i2c_delay(lsi_dev_t *d)
+{
+    uint64_t now = lsi_now();
+    uint64_t start = now;
+    uint64_t target = now + d->i2c_delay_ns - d->clock_overhead_ns;
+
+    while (now < target)
+        now = lsi_now();
+
+    if (now - target > d->i2c_jitter_max_ns)
+        d->i2c_jitter_max_ns = now - target;
+
+    stat_end(d, TIMER_I2C_DELAY, start);
+}
+
+static void i2c_print_timing(lsi_dev_t *d)
+{
+    if (!d->i2c_active_ns)
+        return;
+
+    lsi_json_num(d, "i2c_bits", d->i2c_bits);
+    lsi_json_num(d, "i2c_bus_ms", d->i2c_active_ns / 1e6);
+
+    printf("I2C: %lu bits in %.3f ms bus time (%.1f kbit/s), "
+           "worst delay overshoot %" PRIu64 " ns\n", d->i2c_bits,
+           d->i2c_active_ns / 1e6, d->i2c_bits * 1e6 / d->i2c_active_ns,
+           d->i2c_jitter_max_ns);
+}
+
+static void i2c_set_pins(lsi_dev_t *d, uint32_t val)
+{
+    if (val == d->i2c_pins)
+        return;
+    d->i2c_pins = val;
+    chip_write32(d, CHIP_I2C_PINS, val);
+}
+
+static void set_sda(lsi_dev_t *d, int sda)
+{
+    if (sda)
+        i2c_set_pins(d, d->i2c_pins & ~CHIP_I2C_SDA_DRV);
+    else
+        i2c_set_pins(d, d->i2c_pins | CHIP_I2C_SDA_DRV);
+}
+
+static void set_scl(lsi_dev_t *d, int scl)
+{
+    if (scl)
+        i2c_set_pins(d, d->i2c_pins & ~CHIP_I2C_SCL_DRV);
+    else
+        i2c_set_pins(d, d->i2c_pins | CHIP_I2C_SCL_DRV);
+}
+
+static int get_sda(lsi_dev_t *d)
+{
+    return !!(chip_read32(d, CHIP_I2C_PINS) & CHIP_I2C_SDA_RD);
+}
+
+static int wait_scl(lsi_dev_t *d)
+{
+    uint64_t deadline = lsi_now() + 10000000;
+
+    do {
+        if (chip_read32(d, CHIP_I2C_PINS) & CHIP_I2C_SCL_RD)
+            return 0;
+        i2c_delay(d);
+    } while (lsi_now() < deadline);
+    fprintf(stderr, "I2C: SCL timeout!\n");
+    return -1;
+}
+
+static void i2c_stop(lsi_dev_t *d)
+{
+    uint64_t t0 = stat_begin(d);
+
+    i2c_delay(d);
+    set_sda(d, 0);
+    i2c_delay(d);
+    set_scl(d, 1);
+    i2c_delay(d);
+    set_sda(d, 1);
+    i2c_delay(d);
+
+    if (d->i2c_start_ts) {
+        d->i2c_active_ns += lsi_now() - d->i2c_start_ts;
+        d->i2c_start_ts = 0;
+    }
+
+    stat_end(d, TIMER_I2C_STOP, t0);
+}
+
+static void i2c_start(lsi_dev_t *d)
+{
+    uint64_t t0 = stat_begin(d);
+
+    if (!d->i2c_start_ts)
+        d->i2c_start_ts = lsi_now();
+
+    i2c_delay(d);
+    set_sda(d, 1);
+    i2c_delay(d);
+    set_scl(d, 1);
+    i2c_delay(d);
+    wait_scl(d);
+    set_sda(d, 0);
+    i2c_delay(d);
+    set_scl(d, 0);
+    i2c_delay(d);
+
+    stat_end(d, TIMER_I2C_START, t0);
+}
+
+static void i2c_sendbit(lsi_dev_t *d, int bit)
+{
+    uint64_t t0 = stat_begin(d);
+
+    d->i2c_bits++;
+    set_sda(d, bit);
+    i2c_delay(d);
+    set_scl(d, 1);
+    wait_scl(d);
+    i2c_delay(d);
+    set_scl(d, 0);
+    i2c_delay(d);
+
+    stat_end(d, TIMER_I2C_BIT, t0);
+}
+
+static int i2c_getbit(lsi_dev_t *d)
+{
+    uint64_t t0 = stat_begin(d);
+
+    d->i2c_bits++;
+    set_sda(d, 1);
+    i2c_delay(d);
+    set_scl(d, 1);
+    wait_scl(d);
+    i2c_delay(d);
+    int val = get_sda(d);
+    set_scl(d, 0);
+    i2c_delay(d);
+
+    stat_end(d, TIMER_I2C_BIT, t0);
+    return val;
+}
+
+static void i2c_sendbyte(lsi_dev_t *d, uint8_t byte)
+{
+    uint64_t t0 = stat_begin(d);
+
+    for (int i = 0x80; i ; i >>= 1)
+        i2c_sendbit(d, byte & i);
+
+    stat_end(d, TIMER_I2C_BYTE, t0);
+}
+
+static uint8_t i2c_getbyte(lsi_dev_t *d)
+{
+    uint64_t t0 = stat_begin(d);
+    uint8_t val = 0;
+
+    for (int i = 0x80; i ; i >>= 1)
+        if (i2c_getbit(d))
+            val |= i;
+
+    stat_end(d, TIMER_I2C_BYTE, t0);
+    return val;
+}
+
+static void i2c_bus_reset(lsi_dev_t *d)
+{
+    d->i2c_pins = chip_read32(d, CHIP_I2C_PINS);
+    d->i2c_pins &= ~(CHIP_I2C_SCL_RD | CHIP_I2C_SDA_RD);
+
+    // Make sure things are reset
+    for (int i = 0; i < 9; i++)
+        i2c_sendbit(d, 1);
+    i2c_stop(d);
+    i2c_start(d);
+    i2c_stop(d);
+}
+
+// Send a byte and return the ACK bit (0 = ACK)
+static int i2c_write_byte(lsi_dev_t *d, uint8_t byte)
+{
+    i2c_sendbyte(d, byte);
+    return i2c_getbit(d);
+}
+
+// Read a byte and send the ACK (or NAK for the last byte)
+static uint8_t i2c_read_byte(lsi_dev_t *d, int nak)
+{
+    uint8_t val = i2c_getbyte(d);
+    i2c_sendbit(d, nak);
+    return val;
+}
+
+/*
+ * Send a start condition, the device address and the (1 or 2 byte) EEPROM
+ * offset, as a write. Returns 0 if every byte was ACKed.
+ */
+static int lsi_i2c_address(lsi_dev_t *d, int offset, const char *what)
+{
+    i2c_start(d);
+    if (i2c_write_byte(d, (d->sbr_addr << 1) | 0)) {
+        fprintf(stderr, "SBR %s failed: EEPROM did not ACK address W\n", what);
+        return -1;
+    }
+
+    if (d->eep_type == EEPROM_TYPE_16BIT) {
+        if (i2c_write_byte(d, offset >> 8)) {
+            fprintf(stderr, "SBR %s failed: EEPROM did not ACK offset1\n", what);
+            return -1;
+        }
+    }
+
+    if (i2c_write_byte(d, offset & 0xff)) {
+        fprintf(stderr, "SBR %s failed: EEPROM did not ACK offset0\n", what);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int lsi_i2c_init(lsi_dev_t *d)
+{
+    uint32_t val;
+
+    // Still open from the previous operation of a batch
+    if (d->i2c_open) {
+        d->i2c_active_ns = 0;
+        d->i2c_bits = 0;
+        d->i2c_jitter_max_ns = 0;
+        return 0;
+    }
+
+    val = dcr_read32(d, DCR_SBR_CONFIG);
+    if (val & 2) {
+        d->sbr_addr = 0x54;
+    } else {
+        d->sbr_addr = 0x50;
+    }
+    lsi_info("Using I2C address 0x%02x\n", d->sbr_addr);
+    if (val & 8) {
+        d->eep_type = EEPROM_TYPE_16BIT;
+    } else {
+        d->eep_type = EEPROM_TYPE_8BIT;
+    }
+    lsi_info("Using EEPROM type %d\n", d->eep_type);
+
+    if (opts.page_size)
+        d->eep_page = opts.page_size;
+    else if (d->eep_type == EEPROM_TYPE_16BIT)
+        d->eep_page = EEPROM_PAGE_16BIT;
+    else
+        d->eep_page = EEPROM_PAGE_8BIT;
+    lsi_info("Using EEPROM page size %d\n", d->eep_page);
+
+    lsi_phase(d, "i2c_init");
+    lsi_json_num(d, "sbr_addr", d->sbr_addr);
+    lsi_json_str(d, "eep_type",
+                 d->eep_type == EEPROM_TYPE_16BIT ? "16bit" : "8bit");
+    lsi_json_num(d, "eep_page", d->eep_page);
+
+    i2c_setup_timing(d, opts.i2c_speed);
+
+    chip_write32(d, CHIP_I2C_RESET, 1);
+    do {
+        i2c_delay(d);
+    } while (chip_read32(d, CHIP_I2C_RESET) & 1);
+
+    val = dcr_read32(d, DCR_I2C_SELECT);
+    val |= 0x800000;
+    dcr_write32(d, DCR_I2C_SELECT, val);
+
+    lsi_probe_write_step(d);
+
+    d->i2c_open = 1;
+    i2c_bus_reset(d);
+
+    return 0;
+}
+
+static int lsi_i2c_close(lsi_dev_t *d)
+{
+    uint32_t val;
+
+    if (d->i2c_keep)
+        return 0;
+    d->i2c_open = 0;
+
+    chip_write32(d, CHIP_I2C_RESET, 1);
+    do {
+        i2c_delay(d);
+    } while (chip_read32(d, CHIP_I2C_RESET) & 1);
+
+    val = dcr_read32(d, DCR_I2C_SELECT);
+    val &= ~0x800000;
+    dcr_write32(d, DCR_I2C_SELECT, val);
+
+    return 0;
+}
+
+static int lsi_i2c_read_sbr(lsi_dev_t *d, int offset, int len, uint8_t *buf)
+{
+    if (lsi_i2c_address(d, offset, "read"))
+        return -1;
+
+    i2c_start(d);
+    if (i2c_write_byte(d, (d->sbr_addr << 1) | 1)) {
+        fprintf(stderr, "SBR read failed: EEPROM did not ACK address R\n");
+        return -1;
+    }
+
+    for (int i = 0; i < len; i++)
+        buf[i] = i2c_read_byte(d, i == (len - 1));
+
+    i2c_stop(d);
+
+    return 0;
+}
+
+/*
+ * Wait for the EEPROM to finish its internal write cycle. It does not ACK its
+ * address while busy, so keep addressing it until it does.
+ */
+static int lsi_i2c_wait_write(lsi_dev_t *d)
+{
+    uint64_t deadline = lsi_now() + EEPROM_WRITE_TIMEOUT_NS;
+    int nak;
+
+    do {
+        i2c_start(d);
+        nak = i2c_write_byte(d, (d->sbr_addr << 1) | 0);
+        i2c_stop(d);
+        if (!nak)
+            return 0;
+    } while (lsi_now() < deadline);
+
+    fprintf(stderr, "SBR write failed: EEPROM write cycle timed out\n");
+    return -1;
+}
+
+static int lsi_i2c_write_sbr(lsi_dev_t *d, int offset, int len, uint8_t *buf)
+{
+    int end = offset + len;
+    int chunk;
+
+    // Write page by page; a page write must not cross a page boundary or it
+    // wraps around within the page.
+    for (int pos = offset; pos < end; pos += chunk)
+    {
+        chunk = d->eep_page - (pos % d->eep_page);
+        if (chunk > end - pos)
+            chunk = end - pos;
+
+        if (lsi_i2c_address(d, pos, "write"))
+            return -1;
+
+        for (int i = 0; i < chunk; i++) {
+            if (i2c_write_byte(d, buf[pos - offset + i])) {
+                fprintf(stderr, "SBR write failed: EEPROM did not ACK data\n");
+                return -1;
+            }
+        }
+        i2c_stop(d);
+
+        if (lsi_i2c_wait_write(d))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int lsi_i2c_write_diff(lsi_dev_t *d, int offset, int len,
+                              const uint8_t *old, uint8_t *new);
+
+/*
+ * Read back a just-written range in one sequential read and rewrite whatever
+ * did not stick.
+ */
+static int lsi_i2c_verify(lsi_dev_t *d, int offset, int len, uint8_t *buf)
+{
+    uint8_t *readback;
+    int ret = -1;
+
+    if (opts.no_verify)
+        return 0;
+
+    readback = malloc(len);
+    if (!readback) {
+        perror("malloc");
+        return -1;
+    }
+
+    lsi_phase(d, "verify");
+    for (int attempt = 0; attempt <= SBR_VERIFY_RETRIES; attempt++) {
+        int bad = 0;
+
+        printf("Verifying...\n");
+        if (lsi_i2c_read_sbr(d, offset, len, readback) < 0)
+            break;
+
+        for (int i = 0; i < len; i++) {
+            if (readback[i] == buf[i])
+                continue;
+            if (bad++ < 16)
+                printf(" Mismatch at 0x%04x: wrote 0x%02x, read 0x%02x\n",
+                       offset + i, buf[i], readback[i]);
+        }
+        if (!bad) {
+            printf("Verify OK\n");
+            ret = 0;
+            break;
+        }
+        printf(" %d bytes differ\n", bad);
+
+        if (attempt == SBR_VERIFY_RETRIES) {
+            fprintf(stderr, "Verify failed\n");
+            break;
+        }
+
+        printf("Rewriting failed bytes...\n");
+        if (lsi_i2c_write_diff(d, offset, len, readback, buf) < 0)
+            break;
+    }
+
+    free(readback);
+    return ret;
+}
+
+#define EEPROM_CHUNK            256
+#define EEPROM_MIN_SIZE_16BIT   0x1000
+#define EEPROM_MAX_SIZE         0x10000
+
+/*
+ * Sequential read of a whole range in one transaction, written out in
+ * chunks as it comes in.
+ */
+static int lsi_i2c_read_stream(lsi_dev_t *d, int offset, int len, int fd)
+{
+    uint8_t buf[EEPROM_CHUNK];
+    int pos = 0;
+
+    if (lsi_i2c_address(d, offset, "read"))
+        return -1;
+
+    i2c_start(d);
+    if (i2c_write_byte(d, (d->sbr_addr << 1) | 1)) {
+        fprintf(stderr, "EEPROM read failed: EEPROM did not ACK address R\n");
+        return -1;
+    }
+
+    while (pos < len) {
+        int chunk = len - pos < EEPROM_CHUNK ? len - pos : EEPROM_CHUNK;
+
+        for (int i = 0; i < chunk; i++)
+            buf[i] = i2c_read_byte(d, pos + i == len - 1);
+        if (write(fd, buf, chunk) != chunk) {
+            perror("write");
+            i2c_stop(d);
+            return -1;
+        }
+        pos += chunk;
+    }
+
+    i2c_stop(d);
+    return 0;
+}
+
+/*
+ * Find the EEPROM size. 16-bit addressed parts ignore the address bits above
+ * their size, so the first power of two that reads back the same data as
+ * offset 0 is the size. 8-bit parts are addressed up to 256 bytes here.
+ * Returns 0 if the size cannot be told, i.e. the start of the part is blank.
+ */
+static int lsi_i2c_size(lsi_dev_t *d)
+{
+    uint8_t ref[32], probe[32];
+    int uniform = 1;
+
+    if (d->eep_type != EEPROM_TYPE_16BIT)
+        return SBR_SIZE;
+    if (opts.eeprom_size)
+        return opts.eeprom_size;
+
+    if (lsi_i2c_read_sbr(d, 0, sizeof(ref), ref) < 0)
+        return -1;
+    for (int i = 1; i < sizeof(ref); i++)
+        uniform &= ref[i] == ref[0];
+    if (uniform)
+        return 0;
+
+    for (int size = EEPROM_MIN_SIZE_16BIT; size < EEPROM_MAX_SIZE; size <<= 1) {
+        if (lsi_i2c_read_sbr(d, size, sizeof(probe), probe) < 0)
+            return -1;
+        if (!memcmp(ref, probe, sizeof(ref)))
+            return size;
+    }
+    return EEPROM_MAX_SIZE;
+}
+
+static const char *ioc_state_name(uint32_t doorbell)
+{
+    if (doorbell == 0xffffffff)
+        return "DEAD";
+
+    switch (doorbell & MPI2_DOORBELL_STATE_MASK) {
+    case 0:
+        return "RESET";
+    case MPI2_DOORBELL_READY:
+        return "READY";
+    case MPI2_DOORBELL_OPERATIONAL:
+        return "OPERATIONAL";
+    case MPI2_DOORBELL_FAULT:
+        return "FAULT";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+static void print_ioc_state(lsi_dev_t *d)
+{
+    uint32_t doorbell = read32(d, MPI2_DOORBELL);
+
+    lsi_json_hex(d, "doorbell", doorbell);
+    lsi_json_str(d, "ioc_state", ioc_state_name(doorbell));
+
+    printf("IOC is ");
+    if (!(doorbell & MPI2_DOORBELL_STATE_MASK)) {
+        printf("RESET ");
+    }
+    if (doorbell & MPI2_DOORBELL_READY) {
+        printf("READY ");
+    }
+    if (doorbell & MPI2_DOORBELL_OPERATIONAL) {
+        printf("OPERATIONAL ");
+    }
+    if (doorbell & MPI2_DOORBELL_FAULT) {
+        printf("FAULT ");
+    }
+    printf("\n");
+}
+
+static int do_info(lsi_dev_t *d)
+{
+    lsi_regop_t regs[] = {
+        { REGOP_READ, MPI2_DOORBELL },
+        { REGOP_READ, d->r_diag },
+        { REGOP_DCR_READ, DCR_I2C_SELECT },
+        { REGOP_DCR_READ, DCR_SBR_CONFIG },
+        { REGOP_CHIP_READ, CHIP_I2C_PINS },
+    };
+
+    lsi_regops(d, regs, 5);
+
+    printf("Registers:\n");
+    printf(" DOORBELL:       0x%08x\n", regs[0].val);
+    printf(" DIAG:           0x%08x\n", regs[1].val);
+    printf(" DCR_I2C_SELECT: 0x%08x\n", regs[2].val);
+    printf(" DCR_SBR_SELECT: 0x%08x\n", regs[3].val);
+    printf(" CHIP_I2C_PINS:  0x%08x\n", regs[4].val);
+
+    lsi_json_hex(d, "diag", regs[1].val);
+    lsi_json_hex(d, "dcr_i2c_select", regs[2].val);
+    lsi_json_hex(d, "dcr_sbr_config", regs[3].val);
+    lsi_json_hex(d, "chip_i2c_pins", regs[4].val);
+
+    print_ioc_state(d);
+
+    return 0;
+}
+
+static int do_readsbr(lsi_dev_t *d, const char *filename)
+{
+    uint8_t sbr[256];
+    int fd, ret;
+
+    ret = lsi_i2c_init(d);
+    if (ret < 0)
+        return ret;
+
+    printf("Reading SBR...\n");
+    lsi_phase(d, "sbr_read");
+    ret = lsi_i2c_read_sbr(d, 0, sizeof(sbr), sbr);
+    if (ret < 0)
+        goto close;
+
+    if (!strcmp(filename, "-")) {
+        fd = opts.data_fd;
+    } else {
+        fd = open(filename, O_CREAT|O_WRONLY|O_TRUNC, 0666);
+        if (fd < 0) {
+            perror("open");
+            ret = -1;
+            goto close;
+        }
+    }
+    ret = write(fd, sbr, sizeof(sbr));
+    if (fd != opts.data_fd)
+        close(fd);
+    if (ret != sizeof(sbr)) {
+        perror("write");
+        ret = -1;
+        goto close;
+    }
+    printf("SBR saved to %s\n", filename);
+    ret = 0;
+
+close:
+    lsi_i2c_close(d);
+    if (!ret)
+        i2c_print_timing(d);
+    return ret;
+}
+
+static int do_writesbr(lsi_dev_t *d, const char *filename)
+{
+    uint8_t sbr[256];
+    int ret;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    ret = read(fd, sbr, sizeof(sbr));
+    close(fd);
+    if (ret != sizeof(sbr)) {
+        if (ret >= 0)
+            fprintf(stderr, "%s: expected %zu bytes\n", filename, sizeof(sbr));
+        else
+            perror("read");
+        return -1;
+    }
+
+    ret = lsi_i2c_init(d);
+    if (ret < 0)
+        return ret;
+
+    printf("Writing SBR...\n");
+    lsi_phase(d, "sbr_write");
+    ret = lsi_i2c_write_sbr(d, 0, sizeof(sbr), sbr);
+    if (ret < 0)
+        goto close;
+    ret = lsi_i2c_verify(d, 0, sizeof(sbr), sbr);
+    if (ret < 0)
+        goto close;
+    printf("SBR written from %s\n", filename);
+
+close:
+    lsi_i2c_close(d);
+    if (!ret)
+        i2c_print_timing(d);
+    return ret;
+}
+
+static uint8_t sbr_checksum(const uint8_t *buf, int len)
+{
+    uint8_t sum = 0x5b;
+
+    for (int i = 0; i < len; i++)
+        sum -= buf[i];
+    return sum;
+}
+
+static int sbr_patch(uint8_t *sbr, const char *arg)
+{
+    char name[32];
+    const char *eq = strchr(arg, '=');
+    char *end;
+
+    if (!eq || eq == arg || eq - arg >= sizeof(name)) {
+        fprintf(stderr, "Invalid patch (expected FIELD=VALUE): %s\n", arg);
+        return -1;
+    }
+    memcpy(name, arg, eq - arg);
+    name[eq - arg] = 0;
+
+    uint64_t val = strtoull(eq + 1, &end, 0);
+    if (!eq[1] || *end) {
+        fprintf(stderr, "Invalid value for %s: %s\n", name, eq + 1);
+        return -1;
+    }
+
+    if (!strcmp(name, "SASAddr")) {
+        printf(" SASAddr: 0x%016" PRIx64 "\n", val);
+        memset(sbr + SBR_SAS_ADDR, 0, SBR_SAS_ADDR_CSUM + 1 - SBR_SAS_ADDR);
+        if (val) {
+            for (int i = 0; i < 8; i++)
+                sbr[SBR_SAS_ADDR + i] = val >> (56 - 8 * i);
+            sbr[SBR_SAS_ADDR_CSUM] = sbr_checksum(sbr + SBR_SAS_ADDR, 8);
+        }
+        return 0;
+    }
+
+    for (const sbr_field_t *f = sbr_fields; f->name; f++) {
+        if (strcmp(f->name, name))
+            continue;
+        if (f->size < 8 && (val >> (8 * f->size))) {
+            fprintf(stderr, "Value for %s does not fit in %d bytes\n",
+                    name, f->size);
+            return -1;
+        }
+        printf(" %s: 0x%0*" PRIx64 "\n", name, 2 * f->size, val);
+        for (int i = 0; i < f->size; i++) {
+            sbr[SBR_MFG0 + f->offset + i] = val >> (8 * i);
+            sbr[SBR_MFG1 + f->offset + i] = val >> (8 * i);
+        }
+        sbr[SBR_MFG0 + SBR_MFG_SIZE - 1] =
+            sbr_checksum(sbr + SBR_MFG0, SBR_MFG_SIZE - 1);
+        sbr[SBR_MFG1 + SBR_MFG_SIZE - 1] =
+            sbr_checksum(sbr + SBR_MFG1, SBR_MFG_SIZE - 1);
+        return 0;
+    }
+
+    fprintf(stderr, "Unknown field %s\n", name);
+    return -1;
+}
+
+/*
+ * Write only what differs between old and new: for every EEPROM page with
+ * changes, one page write covering the first to the last changed byte.
+ */
+static int lsi_i2c_write_diff(lsi_dev_t *d, int offset, int len,
+                              const uint8_t *old, uint8_t *new)
+{
+    int bytes = 0, pages = 0;
+
+    for (int page = offset - (offset % d->eep_page); page < offset + len;
+         page += d->eep_page) {
+        int first = -1, last = -1;
+
+        for (int i = page; i < page + d->eep_page; i++) {
+            if (i < offset || i >= offset + len)
+                continue;
+            if (old[i - offset] != new[i - offset]) {
+                if (first < 0)
+                    first = i;
+                last = i;
+            }
+        }
+        if (first < 0)
+            continue;
+
+        if (lsi_i2c_write_sbr(d, first, last - first + 1, new + first - offset))
+            return -1;
+        bytes += last - first + 1;
+        pages++;
+    }
+
+    printf("Wrote %d bytes in %d page writes\n", bytes, pages);
+    return 0;
+}
+
+static int do_patchsbr(lsi_dev_t *d, int argc, char **argv)
+{
+    uint8_t sbr[SBR_SIZE], new[SBR_SIZE];
+    int ret;
+
+    ret = lsi_i2c_init(d);
+    if (ret < 0)
+        return ret;
+
+    printf("Reading SBR...\n");
+    lsi_phase(d, "sbr_read");
+    ret = lsi_i2c_read_sbr(d, 0, sizeof(sbr), sbr);
+    if (ret < 0)
+        return ret;
+
+    memcpy(new, sbr, sizeof(new));
+
+    printf("Patching:\n");
+    for (int i = 0; i < argc; i++) {
+        ret = sbr_patch(new, argv[i]);
+        if (ret < 0) {
+            lsi_i2c_close(d);
+            return ret;
+        }
+    }
+
+    if (!memcmp(sbr, new, sizeof(sbr))) {
+        printf("SBR unchanged\n");
+    } else {
+        printf("Writing SBR...\n");
+        lsi_phase(d, "sbr_write");
+        ret = lsi_i2c_write_diff(d, 0, sizeof(sbr), sbr, new);
+        if (ret < 0)
+            return ret;
+        ret = lsi_i2c_verify(d, 0, sizeof(new), new);
+        if (ret < 0)
+            return ret;
+        printf("SBR patched\n");
+    }
+
+    lsi_i2c_close(d);
+    i2c_print_timing(d);
+    return 0;
+}
+
+static int parse_eeprom_arg(const char *arg, const char *what)
+{
+    char *end;
+    long val = strtol(arg, &end, 0);
+
+    if (*end || val < 0 || val > EEPROM_MAX_SIZE) {
+        fprintf(stderr, "Invalid %s: %s\n", what, arg);
+        return -1;
+    }
+    return val;
+}
+
+static int do_readeeprom(lsi_dev_t *d, int argc, char **argv)
+{
+    int offset = 0, len = -1, size, fd;
+    int ret = -1;
+
+    if (argc > 1 && (offset = parse_eeprom_arg(argv[1], "offset")) < 0)
+        goto out;
+    if (argc > 2 && (len = parse_eeprom_arg(argv[2], "length")) < 0)
+        goto out;
+
+    if (lsi_i2c_init(d) < 0)
+        goto out;
+
+    size = lsi_i2c_size(d);
+    if (size < 0)
+        goto close;
+    // Reading past the end of a smaller part just wraps around
+    if (!size) {
+        printf("Cannot detect the EEPROM size from blank data, assuming %d "
+               "bytes\n", EEPROM_MAX_SIZE);
+        size = EEPROM_MAX_SIZE;
+    }
+    printf("EEPROM size: %d bytes\n", size);
+    lsi_json_num(d, "eeprom_size", size);
+
+    if (len < 0)
+        len = offset < size ? size - offset : 0;
+    if (offset + len > size || !len) {
+        fprintf(stderr, "Range 0x%x+0x%x is outside the EEPROM\n", offset, len);
+        goto close;
+    }
+
+    if (!strcmp(argv[0], "-")) {
+        fd = opts.data_fd;
+    } else {
+        fd = open(argv[0], O_CREAT|O_WRONLY|O_TRUNC, 0666);
+        if (fd < 0) {
+            perror("open");
+            goto close;
+        }
+    }
+
+    uint64_t start = lsi_now();
+    printf("Reading 0x%x bytes from 0x%x...\n", len, offset);
+    lsi_phase(d, "eeprom_read");
+    ret = lsi_i2c_read_stream(d, offset, len, fd);
+    if (fd != opts.data_fd)
+        close(fd);
+    if (ret < 0)
+        goto close;
+
+    double secs = (lsi_now() - start) / 1e9;
+    printf("Read %d bytes in %.3f s (%.1f bytes/s)\n", len, secs, len / secs);
+    i2c_print_timing(d);
+
+close:
+    lsi_i2c_close(d);
+out:
+    return ret;
+}
+
+static int do_writeeeprom(lsi_dev_t *d, int argc, char **argv)
+{
+    uint8_t buf[EEPROM_CHUNK];
+    int offset = 0, size, fd, pos, in = -1;
+    int ret = -1;
+
+    if (!strcmp(argv[0], "-")) {
+        fd = in = 0;
+    } else {
+        fd = open(argv[0], O_RDONLY);
+        if (fd < 0) {
+            perror("open");
+            return -1;
+        }
+    }
+
+    if (argc > 1 && (offset = parse_eeprom_arg(argv[1], "offset")) < 0)
+        goto out;
+
+    if (lsi_i2c_init(d) < 0)
+        goto out;
+
+    size = lsi_i2c_size(d);
+    if (size < 0)
+        goto close;
+    // Writes past the end of a smaller part would wrap around onto the SBR,
+    // and the readback would not notice
+    if (!size) {
+        size = EEPROM_MIN_SIZE_16BIT;
+        printf("Cannot detect the EEPROM size from blank data; writing at "
+               "most %d bytes (see --eeprom-size)\n", size);
+    }
+    printf("EEPROM size: %d bytes\n", size);
+    if (offset >= size) {
+        fprintf(stderr, "Offset 0x%x is outside the EEPROM\n", offset);
+        goto close;
+    }
+
+    // Catch a file that does not fit before writing any of it
+    struct stat st;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && offset + st.st_size > size) {
+        fprintf(stderr, "%s does not fit the EEPROM at 0x%x\n", argv[0],
+                offset);
+        goto close;
+    }
+
+    uint64_t start = lsi_now();
+    printf("Writing from 0x%x...\n", offset);
+    lsi_phase(d, "eeprom_write");
+    for (pos = offset;;) {
+        int len = 0;
+
+        while (len < sizeof(buf)) {
+            ssize_t r = read(fd, buf + len, sizeof(buf) - len);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0) {
+                perror("read");
+                goto close;
+            }
+            if (!r)
+                break;
+            len += r;
+        }
+        if (!len)
+            break;
+        if (pos + len > size) {
+            fprintf(stderr, "Input does not fit the EEPROM (0x%x bytes)\n",
+                    size);
+            goto close;
+        }
+
+        if (lsi_i2c_write_sbr(d, pos, len, buf) < 0)
+            goto close;
+        if (lsi_i2c_verify(d, pos, len, buf) < 0)
+            goto close;
+        pos += len;
+    }
+
+    double secs = (lsi_now() - start) / 1e9;
+    printf("Wrote %d bytes in %.3f s\n", pos - offset, secs);
+    i2c_print_timing(d);
+    ret = 0;
+
+close:
+    lsi_i2c_close(d);
+out:
+    if (fd != in)
+        close(fd);
+    return ret;
+}
+
+#define DUMP_CHUNK              0x10000
+
+static int parse_chip_addr(const char *arg, uint64_t *addr)
+{
+    char *end;
+
+    *addr = strtoull(arg, &end, 0);
+    if (*end || (*addr & 3)) {
+        fprintf(stderr, "Invalid address (must be 4-byte aligned): %s\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+static int do_peek(lsi_dev_t *d, int argc, char **argv)
+{
+    uint64_t addr;
+    long count = 1;
+
+    if (parse_chip_addr(argv[0], &addr) < 0)
+        return -1;
+    if (argc > 1) {
+        char *end;
+        count = strtol(argv[1], &end, 0);
+        if (*end || count <= 0) {
+            fprintf(stderr, "Invalid count: %s\n", argv[1]);
+            return -1;
+        }
+    }
+
+    for (long i = 0; i < count; i++) {
+        if (!(i % 4))
+            printf("%s0x%08" PRIx64 ":", i ? "\n" : "", addr + 4 * i);
+        printf(" %08x", chip_read64(d, addr + 4 * i));
+    }
+    printf("\n");
+    return 0;
+}
+
+static int do_poke(lsi_dev_t *d, int argc, char **argv)
+{
+    uint64_t addr;
+    char *end;
+
+    if (parse_chip_addr(argv[0], &addr) < 0)
+        return -1;
+    uint32_t val = strtoul(argv[1], &end, 0);
+    if (*end) {
+        fprintf(stderr, "Invalid value: %s\n", argv[1]);
+        return -1;
+    }
+    // Reading can have side effects (FIFOs, read-to-clear status), so only
+    // read back when asked to
+    int readback = argc > 2;
+    if (readback && strcmp(argv[2], "readback")) {
+        fprintf(stderr, "Invalid argument: %s\n", argv[2]);
+        return -1;
+    }
+
+    chip_write64(d, addr, val);
+    if (readback)
+        printf("0x%08" PRIx64 ": %08x (read back %08x)\n", addr, val,
+               chip_read64(d, addr));
+    else
+        printf("0x%08" PRIx64 ": %08x\n", addr, val);
+    return 0;
+}
+
+/*
+ * Stream chip memory to a file. The window address cache keeps the high
+ * address programmed and, where the window auto-increments, skips the low
+ * address writes too; otherwise each read costs one posted address write.
+ */
+static int do_dump(lsi_dev_t *d, int argc, char **argv)
+{
+    uint64_t addr, len;
+    uint32_t *buf;
+    char *end;
+    int fd, ret = -1;
+
+    if (parse_chip_addr(argv[1], &addr) < 0)
+        return -1;
+    len = strtoull(argv[2], &end, 0);
+    if (*end || !len || (len & 3)) {
+        fprintf(stderr, "Invalid length (must be a multiple of 4): %s\n",
+                argv[2]);
+        return -1;
+    }
+
+    if (!strcmp(argv[0], "-")) {
+        fd = opts.data_fd;
+    } else {
+        fd = open(argv[0], O_CREAT|O_WRONLY|O_TRUNC, 0666);
+        if (fd < 0) {
+            perror("open");
+            return -1;
+        }
+    }
+
+    buf = malloc(DUMP_CHUNK);
+    if (!buf) {
+        perror("malloc");
+        goto out;
+    }
+
+    printf("Dumping 0x%" PRIx64 " bytes from 0x%08" PRIx64 " (%s)...\n",
+           len, addr,
+           d->rw_rd_step == 4 ? "auto-increment" : "address per word");
+
+    uint64_t start = lsi_now();
+    for (uint64_t pos = 0; pos < len; ) {
+        size_t chunk = len - pos < DUMP_CHUNK ? len - pos : DUMP_CHUNK;
+
+        for (size_t i = 0; i < chunk / 4; i++)
+            buf[i] = chip_read64(d, addr + pos + 4 * i);
+        if (write(fd, buf, chunk) != chunk) {
+            perror("write");
+            goto out;
+        }
+        pos += chunk;
+    }
+
+    double secs = (lsi_now() - start) / 1e9;
+    printf("Dumped %" PRIu64 " bytes in %.3f s (%.2f MB/s)\n", len, secs,
+           len / secs / 1e6);
+    lsi_json_num(d, "bytes", len);
+    lsi_json_num(d, "mb_per_s", len / secs / 1e6);
+    ret = 0;
+
+out:
+    free(buf);
+    if (fd != opts.data_fd)
+        close(fd);
+    return ret;
+}
+
+/*
+ * watch samples a set of registers in a tight loop and records only changes,
+ * into a preallocated ring that keeps the latest WATCH_RING_ENTRIES of them.
+ * The trace file is the header, the register table and the entries, oldest
+ * first, all little endian; watchtool.py decodes it.
+ */
+#define WATCH_MAX_REGS          32
+#define WATCH_RING_ENTRIES      (1 << 20)
+#define WATCH_VERSION           1
+
+enum {
+    WATCH_BAR,
+    WATCH_DCR,
+    WATCH_CHIP,
+};
+
+typedef struct __attribute__((packed)) {
+    char magic[8];
+    uint32_t version;
+    uint32_t nregs;
+    uint64_t start_realtime_ns;
+    uint64_t duration_ns;
+    uint64_t samples;
+    uint64_t entries;
+    uint64_t dropped;
+    uint32_t interval_ns;
+    uint32_t reserved;
+} lsi_watch_hdr_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t space;
+    uint8_t reserved[3];
+    uint32_t addr_high;
+    uint32_t addr;
+    uint32_t initial;
+    char name[16];
+} lsi_watch_reg_t;
+
+typedef struct __attribute__((packed)) {
+    uint64_t t_ns;
+    uint32_t val;
+    uint16_t reg;
+    uint16_t reserved;
+} lsi_watch_entry_t;
+
+static int watch_parse_reg(lsi_dev_t *d, const char *spec, lsi_watch_reg_t *r)
+{
+    static const struct {
+        const char *name;
+        int space;
+        uint32_t addr;
+    } names[] = {
+        { "doorbell", WATCH_BAR, MPI2_DOORBELL },
+        { "diag", WATCH_BAR, ~0U },
+        { "hcdw_size", WATCH_BAR, MPI2_HCDW_SIZE },
+        { "i2c_select", WATCH_DCR, DCR_I2C_SELECT },
+        { "sbr_config", WATCH_DCR, DCR_SBR_CONFIG },
+        { "i2c_pins", WATCH_CHIP, CHIP_I2C_PINS },
+    };
+    static const char *spaces[] = { "bar", "dcr", "chip" };
+    const char *colon = strchr(spec, ':');
+    uint64_t addr;
+    char *end;
+
+    memset(r, 0, sizeof(*r));
+    snprintf(r->name, sizeof(r->name), "%s", spec);
+
+    if (!colon) {
+        for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            if (strcmp(spec, names[i].name))
+                continue;
+            r->space = names[i].space;
+            // DIAG moves with the MPT/MegaRAID register layout
+            r->addr = names[i].addr != ~0U ? names[i].addr : d->r_diag;
+            return 0;
+        }
+        fprintf(stderr, "Unknown register: %s\n", spec);
+        return -1;
+    }
+
+    for (r->space = 0; r->space < 3; r->space++)
+        if (!strncmp(spec, spaces[r->space], colon - spec) &&
+            strlen(spaces[r->space]) == colon - spec)
+            break;
+    addr = strtoull(colon + 1, &end, 0);
+    if (r->space == 3 || *end || (r->space != WATCH_DCR && (addr & 3))) {
+        fprintf(stderr, "Invalid register (bar:, dcr: or chip:<addr>): %s\n",
+                spec);
+        return -1;
+    }
+    if (r->space == WATCH_BAR && addr >= 0x1000) {
+        fprintf(stderr, "BAR offset out of range: %s\n", spec);
+        return -1;
+    }
+    r->addr = addr;
+    r->addr_high = addr >> 32;
+    return 0;
+}
+
+static inline uint32_t watch_read(lsi_dev_t *d, const lsi_watch_reg_t *r)
+{
+    switch (r->space) {
+    case WATCH_BAR:
+        return read32(d, r->addr);
+    case WATCH_DCR:
+        return dcr_read32(d, r->addr);
+    default:
+        return chip_read64(d, ((uint64_t)r->addr_high << 32) | r->addr);
+    }
+}
+
+static int do_watch(lsi_dev_t *d, int argc, char **argv)
+{
+    static const char *defaults[] = {
+        "doorbell", "diag", "i2c_select", "sbr_config", "i2c_pins",
+    };
+    lsi_watch_reg_t regs[WATCH_MAX_REGS];
+    uint32_t last[WATCH_MAX_REGS];
+    lsi_watch_hdr_t hdr = { .magic = "LSIWATCH", .version = WATCH_VERSION };
+    lsi_watch_entry_t *ring;
+    struct sigaction sa = { .sa_handler = lsi_watch_signal }, old_int, old_term;
+    struct timespec ts;
+    uint64_t count = 0;
+    int nregs = 0, ret = -1;
+    char *end;
+
+    long ms = strtol(argv[1], &end, 0);
+    if (*end || ms < 0) {
+        fprintf(stderr, "Invalid duration: %s\n", argv[1]);
+        return -1;
+    }
+    long interval_us = strtol(argv[2], &end, 0);
+    if (*end || interval_us < 0 || interval_us > 1000000) {
+        fprintf(stderr, "Invalid interval: %s\n", argv[2]);
+        return -1;
+    }
+
+    if (argc > 3 + WATCH_MAX_REGS) {
+        fprintf(stderr, "Too many registers (max %d)\n", WATCH_MAX_REGS);
+        return -1;
+    }
+    for (int i = 3; i < argc; i++)
+        if (watch_parse_reg(d, argv[i], &regs[nregs++]) < 0)
+            return -1;
+    if (!nregs)
+        for (int i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+            watch_parse_reg(d, defaults[i], &regs[nregs++]);
+
+    int fd = strcmp(argv[0], "-") ? open(argv[0], O_CREAT|O_WRONLY|O_TRUNC, 0666)
+                                  : opts.data_fd;
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    // Fault the ring in up front so sampling never takes a page fault
+    ring = mmap(NULL, WATCH_RING_ENTRIES * sizeof(*ring), PROT_READ|PROT_WRITE,
+                MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, 0, 0);
+    if (ring == MAP_FAILED) {
+        perror("mmap ring");
+        goto out;
+    }
+
+    for (int i = 0; i < nregs; i++)
+        regs[i].initial = last[i] = watch_read(d, &regs[i]);
+
+    printf("Watching %d registers for %s%s, interval %ld us...\n", nregs,
+           ms ? argv[1] : "ever", ms ? " ms" : " (until interrupted)",
+           interval_us);
+    fflush(stdout);
+
+    lsi_watch_stop = 0;
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr.start_realtime_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    hdr.interval_ns = interval_us * 1000;
+
+    uint64_t start = lsi_now(), now = start, next = start;
+    uint64_t stop = start + ms * 1000000ULL;
+
+    while (!lsi_watch_stop && (!ms || now < stop)) {
+        for (int i = 0; i < nregs; i++) {
+            uint32_t val = watch_read(d, &regs[i]);
+
+            if (val == last[i])
+                continue;
+            last[i] = val;
+
+            lsi_watch_entry_t *e = &ring[count++ % WATCH_RING_ENTRIES];
+            e->t_ns = now - start;
+            e->val = val;
+            e->reg = i;
+        }
+        hdr.samples++;
+
+        if (hdr.interval_ns) {
+            next += hdr.interval_ns;
+            while ((now = lsi_now()) < next && !lsi_watch_stop)
+                ;
+        } else {
+            now = lsi_now();
+        }
+    }
+    hdr.duration_ns = now - start;
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+
+    hdr.nregs = nregs;
+    hdr.entries = count < WATCH_RING_ENTRIES ? count : WATCH_RING_ENTRIES;
+    hdr.dropped = count - hdr.entries;
+
+    // Oldest entries first: the tail of the ring after a wrap, then the head
+    size_t first = count > WATCH_RING_ENTRIES ? count % WATCH_RING_ENTRIES : 0;
+    size_t tail = hdr.entries - first;
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        write(fd, regs, nregs * sizeof(regs[0])) != nregs * sizeof(regs[0]) ||
+        write(fd, ring + first, tail * sizeof(*ring)) != tail * sizeof(*ring) ||
+        write(fd, ring, first * sizeof(*ring)) != first * sizeof(*ring)) {
+        perror("write trace");
+        goto unmap;
+    }
+
+    // An interrupt can land before the first sample completes
+    double secs = hdr.duration_ns / 1e9;
+    printf("%" PRIu64 " samples in %.3f s (%.0f/s, %.3f us/sample), %" PRIu64
+           " transitions", hdr.samples, secs,
+           secs > 0 ? hdr.samples / secs : 0,
+           hdr.samples ? secs * 1e6 / hdr.samples : 0, count);
+    if (hdr.dropped)
+        printf(", oldest %" PRIu64 " dropped", hdr.dropped);
+    printf("\n");
+    lsi_json_num(d, "samples", hdr.samples);
+    lsi_json_num(d, "transitions", count);
+    lsi_json_num(d, "dropped", hdr.dropped);
+    ret = 0;
+
+unmap:
+    munmap(ring, WATCH_RING_ENTRIES * sizeof(*ring));
+out:
+    if (fd != opts.data_fd)
+        close(fd);
+    return ret;
+}
+
+/*
+ * Wait for the IOC doorbell to report the given state, polling with an
+ * exponential backoff so short transitions are seen almost immediately.
+ * Gives up early if the IOC faults.
+ */
+static int lsi_wait_state(lsi_dev_t *d, uint32_t state, int timeout_ms)
+{
+    uint64_t start = lsi_now();
+    uint64_t deadline = start + timeout_ms * 1000000ULL;
+    useconds_t delay = IOC_POLL_MIN_US;
+    uint32_t doorbell;
+
+    for (;;) {
+        doorbell = read32(d, MPI2_DOORBELL);
+        stat_count(d, CNT_IOC_POLL);
+        if (doorbell != 0xffffffff) {
+            uint32_t cur = doorbell & MPI2_DOORBELL_STATE_MASK;
+
+            if (cur == state) {
+                lsi_phase(d, state == MPI2_DOORBELL_READY ? "ready_observed"
+                                                          : "state_observed");
+                printf("IOC %s after %.1f ms\n", ioc_state_name(doorbell),
+                       (lsi_now() - start) / 1e6);
+                return 0;
+            }
+            if (cur == MPI2_DOORBELL_FAULT) {
+                printf("IOC FAULT (code 0x%04x) after %.1f ms\n",
+                       doorbell & 0xffff, (lsi_now() - start) / 1e6);
+                return -1;
+            }
+        }
+
+        if (lsi_now() >= deadline)
+            break;
+
+        usleep(delay);
+        delay *= 2;
+        if (delay > IOC_POLL_MAX_US)
+            delay = IOC_POLL_MAX_US;
+    }
+
+    printf("Timed out after %d ms waiting for IOC state 0x%x (doorbell 0x%08x)\n",
+           timeout_ms, state >> 28, doorbell);
+    return -1;
+}
+
+/*
+ * Wait for a diag reset to complete: leave the chip alone for the PCIe reset
+ * window, then poll until RESET_ADAPTER self-clears.
+ */
+static int lsi_wait_reset(lsi_dev_t *d, int timeout_ms)
+{
+    uint64_t start = lsi_now();
+    uint64_t deadline = start + timeout_ms * 1000000ULL;
+    useconds_t delay = IOC_POLL_MIN_US;
+    uint32_t val;
+
+    usleep(IOC_RESET_READ_DELAY_US);
+
+    for (;;) {
+        val = read32(d, d->r_diag);
+        stat_count(d, CNT_IOC_POLL);
+        if (val != 0xffffffff && !(val & MPI2_DIAG_RESET_ADAPTER)) {
+            lsi_phase(d, "reset_complete");
+            printf("Reset complete after %.1f ms\n", (lsi_now() - start) / 1e6);
+            return 0;
+        }
+
+        if (lsi_now() >= deadline)
+            break;
+
+        usleep(delay);
+        delay *= 2;
+        if (delay > IOC_POLL_MAX_US)
+            delay = IOC_POLL_MAX_US;
+    }
+
+    printf("Timed out after %d ms waiting for reset (diag 0x%08x)\n",
+           timeout_ms, val);
+    return -1;
+}
+
+static int do_reset(lsi_dev_t *d)
+{
+    int ret;
+    uint32_t val;
+
+    ret = lsi_unbind_driver(d);
+    if (ret < 0)
+        return ret;
+
+    printf("Resetting adapter...\n");
+    lsi_phase(d, "diag_write");
+    val = read32(d, d->r_diag);
+    val &= ~MPI2_DIAG_BOOTDEVICE_MASK;
+    val &= ~MPI2_DIAG_FORCE_HCB;
+    val &= ~MPI2_DIAG_HCB_MODE;
+    write32(d, d->r_diag, val);
+
+    // Settle time for the new boot mode before the reset, not a state wait
+    usleep(100000);
+
+    val = read32(d, d->r_diag);
+    val |= MPI2_DIAG_RESET_ADAPTER;
+    lsi_phase(d, "reset_issued");
+    write32(d, d->r_diag, val);
+    lsi_invalidate_cache(d);
+
+    if (lsi_wait_reset(d, opts.timeout_ms) < 0)
+        return -1;
+
+    ret = lsi_wait_state(d, MPI2_DOORBELL_READY, opts.timeout_ms);
+
+    print_ioc_state(d);
+
+    if (ret < 0) {
+        printf("IOC failed to become ready\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int do_halt(lsi_dev_t *d)
+{
+    int ret;
+    uint32_t val;
+
+    ret = lsi_unbind_driver(d);
+    if (ret < 0)
+        return ret;
+
+    printf("Resetting adapter in HCB mode...\n");
+    lsi_phase(d, "diag_write");
+    val = read32(d, d->r_diag);
+    val |= MPI2_DIAG_FORCE_HCB;
+    write32(d, d->r_diag, val);
+    val |= MPI2_DIAG_RESET_ADAPTER;
+    lsi_phase(d, "reset_issued");
+    write32(d, d->r_diag, val);
+    lsi_invalidate_cache(d);
+
+    if (lsi_wait_reset(d, opts.timeout_ms) < 0)
+        return -1;
+
+    lsi_phase(d, "unlock");
+    lsi_reopen(d);
+
+    val = read32(d, d->r_diag);
+    val &= ~MPI2_DIAG_FORCE_HCB;
+    write32(d, d->r_diag, val);
+
+    print_ioc_state(d);
+
+    if (read32(d, MPI2_DOORBELL) & MPI2_DOORBELL_STATE_MASK) {
+        printf("IOC failed to stay in reset\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint64_t fnv1a64(const uint8_t *p, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*
+ * Stage the firmware in a file under the cache directory, named after the
+ * image hash and size. A hugetlbfs file keeps its pages after we exit, so a
+ * later run finds the window already filled in and only maps it again. New
+ * entries are filled under a temporary name and renamed into place once
+ * complete.
+ */
+static int lsi_cache_firmware(lsi_dev_t *d, int fd, size_t length, int share)
+{
+    const char *dir = opts.fw_cache;
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    struct statfs sfs;
+    int cfd, hit = 1, ret = -1;
+
+    uint8_t *img = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (img == MAP_FAILED) {
+        perror("mmap firmware");
+        return -1;
+    }
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror("mkdir firmware cache");
+        goto out;
+    }
+    if (statfs(dir, &sfs) < 0) {
+        perror("statfs firmware cache");
+        goto out;
+    }
+    // Anywhere else the pages are neither contiguous nor kept resident
+    if (sfs.f_type != HUGETLBFS_MAGIC && !d->plain_mem) {
+        fprintf(stderr, "Firmware cache %s is not on hugetlbfs\n", dir);
+        goto out;
+    }
+
+    d->hcdw_size = lsi_hcdw_size(length);
+    size_t page = sfs.f_bsize;
+    size_t map_len = (d->hcdw_size + page - 1) & ~(page - 1);
+
+    snprintf(path, sizeof(path), "%s/%016" PRIx64 "-%zu", dir,
+             fnv1a64(img, length), length);
+
+    // A short entry (an interrupted fill, or a different page size) would
+    // fault with SIGBUS when mapped, so start it over
+    cfd = open(path, O_RDWR);
+    if (cfd >= 0) {
+        struct stat st;
+
+        if (fstat(cfd, &st) < 0 || st.st_size != (off_t)map_len) {
+            fprintf(stderr, "Cached firmware %s has the wrong size, "
+                    "replacing it\n", path);
+            close(cfd);
+            unlink(path);
+            cfd = -1;
+        }
+    }
+    if (cfd < 0) {
+        hit = 0;
+        snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+        cfd = mkstemp(tmp);
+        if (cfd < 0) {
+            perror("create firmware cache entry");
+            goto out;
+        }
+        if (ftruncate(cfd, map_len) < 0) {
+            perror("truncate firmware cache entry");
+            close(cfd);
+            goto drop;
+        }
+    }
+
+    d->hcdw = mmap(NULL, map_len, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE|MAP_LOCKED, cfd, 0);
+    close(cfd);
+    if (d->hcdw == MAP_FAILED) {
+        perror("mmap firmware cache entry");
+        d->hcdw = NULL;
+        goto drop;
+    }
+    d->hcdw_map_len = map_len;
+
+    // The page walk is a few reads; it also catches migrated pages
+    if (d->vfio || d->plain_mem)
+        d->hcdw_phys = (uintptr_t)d->hcdw;
+    else if (lsi_check_hcdw(d) < 0)
+        goto bad;
+
+    uint8_t *dst = d->hcdw + d->hcdw_size - length;
+    if (hit && memcmp(dst, img, length)) {
+        fprintf(stderr, "Cached firmware %s does not match, replacing it\n",
+                path);
+        munmap(d->hcdw, map_len);
+        d->hcdw = NULL;
+        unlink(path);
+        munmap(img, length);
+        return lsi_cache_firmware(d, fd, length, share);
+    }
+    if (!hit) {
+        memset(d->hcdw, 0x42, d->hcdw_size - length);
+        memcpy(dst, img, length);
+        if (rename(tmp, path) < 0) {
+            perror("rename firmware cache entry");
+            goto unmap;
+        }
+    }
+
+    printf("HCDW: %zu KB window %s %s\n", d->hcdw_size >> 10,
+           hit ? "reused from" : "cached in", path);
+    printf("HCDW virtual: %p\n", d->hcdw);
+    if (!d->vfio)
+        printf("HCDW physical: 0x%" PRIx64 "\n", d->hcdw_phys);
+
+    // The parent of a shared boot has no container; workers map it later
+    if (d->vfio && !share) {
+        if (lsi_vfio_map_hcdw(d) < 0)
+            goto unmap;
+        printf("HCDW IOVA: 0x%" PRIx64 "\n", d->hcdw_phys);
+    }
+
+    ret = 0;
+    goto out;
+
+bad:
+    // Unusable pages would fail the same way next time, so do not keep them
+    if (hit)
+        unlink(path);
+unmap:
+    munmap(d->hcdw, map_len);
+    d->hcdw = NULL;
+drop:
+    if (!hit)
+        unlink(tmp);
+out:
+    munmap(img, length);
+    return ret;
+}
+
+static int lsi_stage_firmware(lsi_dev_t *d, const char *filename,
+                              size_t *length, int share)
+{
+    struct stat st;
+    int ret;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("open firmware");
         return fd;
     }
+    if (fstat(fd, &st) < 0) {
+        perror("stat firmware");
+        close(fd);
+        return -1;
+    }
+    if (st.st_size <= 0 || st.st_size > HCDW_MAX_SIZE) {
+        fprintf(stderr, "Firmware size %ld out of range (max %d)\n",
+                (long)st.st_size, HCDW_MAX_SIZE);
+        close(fd);
+        return -1;
+    }
+    *length = st.st_size;
 
-    ret = write(fd, "1", 1);
-    if (ret != 1) {
-        perror("write remove");
-        close(fd);
-        return ret;
+    if (opts.fw_cache) {
+        lsi_phase(d, "firmware_cache");
+        if (!lsi_cache_firmware(d, fd, st.st_size, share))
+            goto check;
+        printf("Firmware cache unavailable, staging normally\n");
     }
 
+    lsi_phase(d, "hcdw_alloc");
+    ret = share ? lsi_map_hcdw(d, st.st_size, 1)
+                : lsi_alloc_hcdw(d, st.st_size);
+    if (ret < 0)
+        goto out;
+
+    printf("Loading firmware...\n");
+    lsi_phase(d, "firmware_load");
+    ret = lsi_load_firmware(d, fd, st.st_size);
+    if (ret < 0)
+        goto out;
+    printf("Loaded %ld bytes\n", (long)st.st_size);
+
+check:
+    // Check the staged copy, which is exactly what the IOC will boot
+    lsi_phase(d, "firmware_check");
+    ret = lsi_check_firmware(d, d->hcdw + d->hcdw_size - st.st_size,
+                             st.st_size);
+
+out:
     close(fd);
+    return ret;
+}
 
-    printf("Rescanning PCI bus...\n");
+/*
+ * Stage and check the firmware once in the parent, before any worker touches
+ * its adapter. A bad image then fails the whole run with every card still up.
+ */
+static int lsi_share_firmware(const char *filename, char **devs, int count)
+{
+    lsi_dev_t *d = &shared_fw.dev;
+    int emu = 1;
 
-    fd = open("/sys/bus/pci/rescan", O_WRONLY|O_TRUNC);
-    if (fd < 0) {
-        if (errno == ENOENT)
-            return 0;
-        perror("open rescan");
-        return fd;
+    for (int i = 0; i < count; i++)
+        emu &= !strncmp(devs[i], "emu", 3);
+
+    memset(d, 0, sizeof(*d));
+    strcpy(d->pci_id, "shared");
+    // Plain memory is enough when each device maps it through its IOMMU
+    d->vfio = opts.vfio;
+    d->plain_mem = emu;
+
+    printf("Staging %s once for %d devices\n", filename, count);
+    if (lsi_stage_firmware(d, filename, &shared_fw.length, 1) < 0) {
+        if (d->hcdw)
+            munmap(d->hcdw, d->hcdw_map_len);
+        d->hcdw = NULL;
+        return -1;
     }
 
-    ret = write(fd, "1", 1);
-    if (ret != 1) {
-        perror("write rescan");
-        close(fd);
+    shared_fw.file = filename;
+    return 0;
+}
+
+static int do_hostboot(lsi_dev_t *d, const char *filename)
+{
+    size_t length;
+    int ret;
+    uint32_t val;
+
+    // Stage the image before the adapter goes down
+    if (shared_fw.file && !strcmp(filename, shared_fw.file))
+        ret = lsi_use_shared_hcdw(d);
+    else
+        ret = lsi_stage_firmware(d, filename, &length, 0);
+    if (ret < 0)
+        goto fail;
+
+    ret = do_halt(d);
+    if (ret < 0)
+        goto fail;
+
+    val = read32(d, d->r_diag);
+    val |= MPI2_DIAG_CLR_FLASH_BAD_SIG;
+    val &= ~MPI2_DIAG_BOOTDEVICE_MASK;
+    val &= ~MPI2_DIAG_FORCE_HCB;
+    val &= ~MPI2_DIAG_RESET_HISTORY;
+    write32(d, d->r_diag, val);
+
+    lsi_phase(d, "hcdw_setup");
+    ret = lsi_setup_hcdw(d);
+    if (ret < 0)
+        goto fail;
+
+    val = read32(d, d->r_diag);
+    val |= MPI2_DIAG_BOOTDEVICE_HCDW;
+    write32(d, d->r_diag, val);
+
+    printf("Booting IOC...\n");
+    lsi_phase(d, "boot");
+
+    val &= ~MPI2_DIAG_HOLD_IOC_RESET;
+    val &= ~MPI2_DIAG_FORCE_HCB;
+    write32(d, d->r_diag, val);
+
+    ret = lsi_wait_state(d, MPI2_DOORBELL_READY, opts.timeout_ms);
+
+    print_ioc_state(d);
+
+    if (ret < 0) {
+        printf("IOC failed to become ready\n");
+        return -1;
+    }
+
+    // The IOC is already up at this point; just give the new firmware a
+    // moment before the HCDW it booted from goes away.
+    lsi_phase(d, "settle");
+    usleep(500000);
+
+    printf("IOC Host Boot successful.\n");
+
+    lsi_phase(d, "hcdw_disable");
+    lsi_disable_hcdw(d);
+
+    return 0;
+
+fail:
+    lsi_free_hcdw(d);
+    return ret < 0 ? ret : -1;
+}
+
+static int do_unbind(lsi_dev_t *d)
+{
+    return lsi_unbind_driver(d);
+}
+
+static int do_rescan(lsi_dev_t *d)
+{
+    int ret;
+
+    ret = lsi_unbind_driver(d);
+    if (ret < 0)
         return ret;
+
+    // vfio-pci waits for us to let go before the device can be removed
+    if (d->vfio)
+        lsi_close(d);
+
+    return lsi_rescan(d);
+}
+
+#define BENCH_MAX_SAMPLES       1000
+
+typedef void (*lsi_bench_fn_t)(lsi_dev_t *d, void *arg);
+
+typedef struct {
+    uint8_t *win;
+    size_t win_size;
+    size_t len;
+    int fd;
+} lsi_bench_hcdw_t;
+
+static int bench_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Time `samples` batches of `batch` calls each and print one result line.
+ * Lines start with "BENCH" and are key=value pairs so scripts can pick them
+ * out of the normal output.
+ */
+static void bench_run(lsi_dev_t *d, const char *filter, const char *name,
+                      int samples, int batch, size_t bytes,
+                      lsi_bench_fn_t fn, void *arg)
+{
+    uint64_t t[BENCH_MAX_SAMPLES];
+    uint64_t total = 0;
+
+    if (filter && fnmatch(filter, name, 0))
+        return;
+    if (samples > BENCH_MAX_SAMPLES)
+        samples = BENCH_MAX_SAMPLES;
+
+    // Warm up caches and the address cache
+    for (int i = 0; i < batch; i++)
+        fn(d, arg);
+
+    for (int s = 0; s < samples; s++) {
+        uint64_t start = lsi_now();
+        for (int i = 0; i < batch; i++)
+            fn(d, arg);
+        t[s] = lsi_now() - start;
+        total += t[s];
     }
+    qsort(t, samples, sizeof(t[0]), bench_cmp);
 
-    close(fd);
+    double ops = (double)samples * batch;
+    double ns_op = total / ops;
 
-    printf("PCI bus rescan complete.\n");
+    printf("BENCH name=%s ops=%.0f ns_op=%.1f ops_s=%.0f p50_ns=%.1f "
+           "p99_ns=%.1f", name, ops, ns_op, 1e9 / ns_op,
+           (double)t[samples / 2] / batch,
+           (double)t[samples * 99 / 100] / batch);
+    if (bytes)
+        printf(" bytes_s=%.0f", bytes / ns_op * 1e9);
+    printf("\n");
+    fflush(stdout);
+}
+
+static void bench_read32(lsi_dev_t *d, void *arg)
+{
+    read32(d, MPI2_DOORBELL);
+}
+
+static void bench_chip_read(lsi_dev_t *d, void *arg)
+{
+    chip_read32(d, CHIP_I2C_PINS);
+}
+
+// Write back the current (released) pin state, which is harmless
+static void bench_chip_write(lsi_dev_t *d, void *arg)
+{
+    chip_write32(d, CHIP_I2C_PINS, *(uint32_t *)arg);
+}
+
+static void bench_dcr_read(lsi_dev_t *d, void *arg)
+{
+    dcr_read32(d, DCR_I2C_SELECT);
+}
+
+static void bench_dcr_write(lsi_dev_t *d, void *arg)
+{
+    dcr_write32(d, DCR_I2C_SELECT, *(uint32_t *)arg);
+}
+
+// Clocking with SDA released is ignored by the EEPROM outside a transfer
+static void bench_i2c_bit(lsi_dev_t *d, void *arg)
+{
+    i2c_sendbit(d, 1);
+}
+
+static void bench_i2c_byte(lsi_dev_t *d, void *arg)
+{
+    i2c_sendbyte(d, 0xff);
+}
+
+static void bench_i2c_xfer(lsi_dev_t *d, void *arg)
+{
+    uint8_t byte;
+
+    lsi_i2c_read_sbr(d, 0, 1, &byte);
+}
+
+static void bench_sbr_read(lsi_dev_t *d, void *arg)
+{
+    lsi_i2c_read_sbr(d, 0, SBR_SIZE, arg);
+}
+
+static void bench_sbr_write(lsi_dev_t *d, void *arg)
+{
+    lsi_i2c_write_sbr(d, 0, SBR_SIZE, arg);
+}
+
+static void bench_hcdw_memset(lsi_dev_t *d, void *arg)
+{
+    lsi_bench_hcdw_t *h = arg;
+
+    memset(h->win, 0x42, h->win_size);
+}
+
+static void bench_hcdw_read(lsi_dev_t *d, void *arg)
+{
+    lsi_bench_hcdw_t *h = arg;
+
+    if (pread(h->fd, h->win + h->win_size - h->len, h->len, 0) != h->len)
+        perror("pread");
+}
+
+static void bench_hcdw_memmove(lsi_dev_t *d, void *arg)
+{
+    lsi_bench_hcdw_t *h = arg;
+
+    memmove(h->win + h->win_size - h->len, h->win, h->len);
+}
+
+// The whole staging path as used by hostboot
+static void bench_hcdw_load(lsi_dev_t *d, void *arg)
+{
+    lsi_bench_hcdw_t *h = arg;
+
+    d->hcdw = h->win;
+    d->hcdw_size = h->win_size;
+    lsi_load_firmware(d, h->fd, h->len);
+    d->hcdw = NULL;
+}
+
+static int bench_hcdw(lsi_dev_t *d, const char *filter, size_t len)
+{
+    static const struct {
+        const char *name;
+        lsi_bench_fn_t fn;
+    } stages[] = {
+        { "memset", bench_hcdw_memset },
+        { "read", bench_hcdw_read },
+        { "memmove", bench_hcdw_memmove },
+        { "load", bench_hcdw_load },
+    };
+    lsi_bench_hcdw_t h;
+    char name[64];
+    FILE *fp;
+    int ret = 0;
+
+    h.len = len;
+    h.win_size = lsi_hcdw_size(len);
+    h.win = mmap(NULL, h.win_size, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, 0, 0);
+    if (h.win == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    // A page-cached image, so the read measures copying rather than disk
+    fp = tmpfile();
+    if (!fp) {
+        perror("tmpfile");
+        munmap(h.win, h.win_size);
+        return -1;
+    }
+    memset(h.win, 0xa5, len);
+    h.fd = fileno(fp);
+    if (pwrite(h.fd, h.win, len, 0) != len) {
+        perror("write");
+        ret = -1;
+        goto out;
+    }
+
+    for (int i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+        snprintf(name, sizeof(name), "hcdw_%s_%zuk", stages[i].name,
+                 len >> 10);
+        bench_run(d, filter, name, 50, 1,
+                  stages[i].fn == bench_hcdw_memset ? h.win_size : len,
+                  stages[i].fn, &h);
+    }
+
+out:
+    fclose(fp);
+    munmap(h.win, h.win_size);
+    return ret;
+}
+
+static void bench_skip(const char *filter, const char *name)
+{
+    if (!filter || !fnmatch(filter, name, 0))
+        printf("Skipping %s on real hardware\n", name);
+}
+
+static int do_bench(lsi_dev_t *d, const char *filter)
+{
+    // Typical IT/IR images are 1-2MB; 3MB exercises a 4MB window
+    static const size_t hcdw_sizes[] = { 256 << 10, 1 << 20, 3 << 20 };
+    uint8_t sbr[SBR_SIZE];
+    uint32_t i2c_select, i2c_pins;
+    int ret;
+
+    bench_run(d, filter, "read32", 1000, 16, 0, bench_read32, NULL);
+    bench_run(d, filter, "chip_read32", 1000, 16, 0, bench_chip_read, NULL);
+    bench_run(d, filter, "dcr_read32", 1000, 16, 0, bench_dcr_read, NULL);
+
+    // The write targets (I2C pins and I2C select) belong to a running IOC
+    // on real hardware
+    if (d->emu) {
+        i2c_pins = chip_read32(d, CHIP_I2C_PINS);
+        bench_run(d, filter, "chip_write32", 1000, 16, 0, bench_chip_write,
+                  &i2c_pins);
+        i2c_select = dcr_read32(d, DCR_I2C_SELECT);
+        bench_run(d, filter, "dcr_write32", 1000, 16, 0, bench_dcr_write,
+                  &i2c_select);
+    } else {
+        bench_skip(filter, "chip_write32");
+        bench_skip(filter, "dcr_write32");
+    }
+
+    ret = lsi_i2c_init(d);
+    if (ret < 0)
+        return ret;
+
+    bench_run(d, filter, "i2c_bit", 1000, 8, 0, bench_i2c_bit, NULL);
+    bench_run(d, filter, "i2c_byte", 500, 1, 0, bench_i2c_byte, NULL);
+    i2c_stop(d);
+    bench_run(d, filter, "i2c_xfer", 100, 1, 1, bench_i2c_xfer, NULL);
+    bench_run(d, filter, "sbr_read", 10, 1, SBR_SIZE, bench_sbr_read, sbr);
+
+    // Don't wear out real EEPROMs; rewriting the same data is still a write
+    if (d->emu) {
+        ret = lsi_i2c_read_sbr(d, 0, SBR_SIZE, sbr);
+        if (ret < 0)
+            return ret;
+        bench_run(d, filter, "sbr_write", 5, 1, SBR_SIZE, bench_sbr_write,
+                  sbr);
+    } else {
+        bench_skip(filter, "sbr_write");
+    }
+
+    lsi_i2c_close(d);
+
+    for (int i = 0; i < sizeof(hcdw_sizes) / sizeof(hcdw_sizes[0]); i++) {
+        ret = bench_hcdw(d, filter, hcdw_sizes[i]);
+        if (ret < 0)
+            return ret;
+    }
 
     return 0;
 }
 
-static void i2c_delay(lsi_dev_t *d)
+static int op_info(lsi_dev_t *d, int argc, char **argv)
 {
-    usleep(5);
+    return do_info(d);
 }
 
-static void set_sda(lsi_dev_t *d, int sda)
+static int op_readsbr(lsi_dev_t *d, int argc, char **argv)
 {
-    uint32_t val = chip_read32(d, CHIP_I2C_PINS);
-    if (sda)
-        val &= ~CHIP_I2C_SDA_DRV;
-    else
-        val |= CHIP_I2C_SDA_DRV;
-    chip_write32(d, CHIP_I2C_PINS, val);
+    return do_readsbr(d, argv[0]);
 }
 
-static void set_scl(lsi_dev_t *d, int scl)
+static int op_writesbr(lsi_dev_t *d, int argc, char **argv)
 {
-    uint32_t val = chip_read32(d, CHIP_I2C_PINS);
-    if (scl)
-        val &= ~CHIP_I2C_SCL_DRV;
-    else
-        val |= CHIP_I2C_SCL_DRV;
-    chip_write32(d, CHIP_I2C_PINS, val);
+    return do_writesbr(d, argv[0]);
+}
+
+static int op_reset(lsi_dev_t *d, int argc, char **argv)
+{
+    return do_reset(d);
+}
+
+static int op_halt(lsi_dev_t *d, int argc, char **argv)
+{
+    return do_halt(d);
+}
+
+static int op_hostboot(lsi_dev_t *d, int argc, char **argv)
+{
+    return do_hostboot(d, argv[0]);
+}
+
+static int op_unbind(lsi_dev_t *d, int argc, char **argv)
+{
+    return do_unbind(d);
+}
+
+static int op_rescan(lsi_dev_t *d, int argc, char **argv)
+{
+    return do_rescan(d);
+}
+
+static int op_bench(lsi_dev_t *d, int argc, char **argv)
+{
+    return do_bench(d, argc ? argv[0] : NULL);
+}
+
+// Operation writes to its file argument
+#define OP_OUTPUT_FILE  0x01
+// Operation gives up the device, so nothing can run after it on the same
+// handle (and serve cannot run it)
+#define OP_RELEASES     0x02
+// Operation uses the SBR EEPROM over I2C
+#define OP_I2C          0x04
+// Writes the SBR EEPROM, so the scan inventory entry goes stale
+#define OP_SBR_WRITE    0x08
+// Operation unbinds the kernel driver anyway, so --vfio may rebind it
+#define OP_UNBINDS      0x10
+
+typedef struct {
+    const char *name;
+    int min_args;
+    int max_args;
+    int flags;
+    int (*fn)(lsi_dev_t *d, int argc, char **argv);
+} lsi_op_t;
+
+static const lsi_op_t lsi_ops[] = {
+    { "info",       0, 0,   0,              op_info },
+    { "readsbr",    1, 1,   OP_OUTPUT_FILE|OP_I2C, op_readsbr },
+    { "writesbr",   1, 1,   OP_I2C|OP_SBR_WRITE, op_writesbr },
+    { "patchsbr",   1, 256, OP_I2C|OP_SBR_WRITE, do_patchsbr },
+    { "readeeprom", 1, 3,   OP_OUTPUT_FILE|OP_I2C, do_readeeprom },
+    { "writeeeprom", 1, 2,  OP_I2C|OP_SBR_WRITE, do_writeeeprom },
+    { "peek",       1, 2,   0,              do_peek },
+    { "poke",       2, 3,   0,              do_poke },
+    { "dump",       3, 3,   OP_OUTPUT_FILE, do_dump },
+    { "watch",      3, 3 + WATCH_MAX_REGS, OP_OUTPUT_FILE, do_watch },
+    { "reset",      0, 0,   OP_UNBINDS,     op_reset },
+    { "halt",       0, 0,   OP_UNBINDS,     op_halt },
+    { "hostboot",   1, 1,   OP_UNBINDS,     op_hostboot },
+    { "unbind",     0, 0,   OP_UNBINDS,     op_unbind },
+    { "rescan",     0, 0,   OP_RELEASES|OP_UNBINDS, op_rescan },
+    { "bench",      0, 1,   0,              op_bench },
+    { NULL },
+};
+
+static const lsi_op_t *lsi_find_op(int argc, char **argv)
+{
+    for (const lsi_op_t *op = lsi_ops; op->name; op++) {
+        if (strcmp(op->name, argv[0]))
+            continue;
+        if (argc - 1 < op->min_args || argc - 1 > op->max_args)
+            return NULL;
+        return op;
+    }
+    return NULL;
+}
+
+#define MAX_STEPS       64
+
+typedef struct {
+    const lsi_op_t *op;
+    int argc;
+    char **argv;
+} lsi_step_t;
+
+/*
+ * Split an operation list on "+" arguments, e.g.
+ * "halt + writesbr sbr.bin + reset", checking each operation's arguments.
+ */
+static int lsi_parse_steps(int argc, char **argv, lsi_step_t *steps)
+{
+    int count = 0, unbinds = 0;
+
+    while (argc > 0) {
+        int n = 0;
+
+        while (n < argc && strcmp(argv[n], "+"))
+            n++;
+
+        if (count >= MAX_STEPS) {
+            fprintf(stderr, "Too many operations (max %d)\n", MAX_STEPS);
+            return -1;
+        }
+        if (!n || !(steps[count].op = lsi_find_op(n, argv))) {
+            fprintf(stderr, "Invalid operation: %s\n", n ? argv[0] : "+");
+            return -1;
+        }
+        if ((steps[count].op->flags & OP_RELEASES) && n < argc) {
+            fprintf(stderr, "%s must be the last operation\n", argv[0]);
+            return -1;
+        }
+        steps[count].argc = n - 1;
+        steps[count].argv = argv + 1;
+        unbinds |= steps[count].op->flags & OP_UNBINDS;
+        count++;
+
+        argv += n;
+        argc -= n;
+        if (argc && --argc == 0) {
+            fprintf(stderr, "Missing operation after +\n");
+            return -1;
+        }
+        argv++;
+    }
+
+    // Binding vfio-pci detaches the kernel driver and its disks
+    if (opts.vfio && !unbinds) {
+        fprintf(stderr, "--vfio unbinds the kernel driver, so it needs one of "
+                "the * operations\n");
+        return -1;
+    }
+
+    return count;
+}
+
+/*
+ * Read a script of operations, one per line with # comments, into an
+ * argument list joined with "+".
+ */
+static int lsi_load_script(const char *path, int *argc, char ***argv)
+{
+    char line[1024];
+    char **args = NULL;
+    int count = 0;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror("open script");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *save, *tok;
+        int first = 1;
+
+        line[strcspn(line, "#")] = 0;
+        for (tok = strtok_r(line, " \t\r\n", &save); tok;
+             tok = strtok_r(NULL, " \t\r\n", &save)) {
+            args = realloc(args, (count + 2) * sizeof(*args));
+            if (first && count)
+                args[count++] = "+";
+            args[count++] = strdup(tok);
+            first = 0;
+        }
+    }
+    fclose(fp);
+
+    if (!count) {
+        fprintf(stderr, "No operations in %s\n", path);
+        return -1;
+    }
+
+    *argc = count;
+    *argv = args;
+    return 0;
 }
 
-static int get_sda(lsi_dev_t *d)
+#define MAX_DEVICES     64
+
+static int lsi_add_device(char **devs, int *count, const char *id)
 {
-    return !!(chip_read32(d, CHIP_I2C_PINS) & CHIP_I2C_SDA_RD);
+    if (*count >= MAX_DEVICES) {
+        fprintf(stderr, "Too many devices (max %d)\n", MAX_DEVICES);
+        return -1;
+    }
+    devs[(*count)++] = strdup(id);
+    return 0;
 }
 
-static int wait_scl(lsi_dev_t *d)
+static int lsi_sysfs_supported(const char *pci_id);
+
+/*
+ * Expand a device list: comma-separated PCI IDs, each of which may be a glob
+ * matched against the SAS2008/2108 functions in /sys/bus/pci/devices.
+ */
+static int lsi_parse_devices(const char *spec, char **devs)
 {
-    for (int i = 0; i < 100; i++)
-    {
-        if (chip_read32(d, CHIP_I2C_PINS) & CHIP_I2C_SCL_RD)
-            return 0;
-        i2c_delay(d);
+    char *copy = strdup(spec);
+    char *save, *tok;
+    int count = 0;
+
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        struct dirent **names;
+        int matched = 0;
+
+        if (!strpbrk(tok, "*?[")) {
+            if (lsi_add_device(devs, &count, tok) < 0)
+                goto fail;
+            continue;
+        }
+
+        int n = scandir("/sys/bus/pci/devices", &names, NULL, alphasort);
+        if (n < 0) {
+            perror("scandir /sys/bus/pci/devices");
+            goto fail;
+        }
+        for (int i = 0; i < n; i++) {
+            if (!fnmatch(tok, names[i]->d_name, 0) && count >= 0 &&
+                lsi_sysfs_supported(names[i]->d_name)) {
+                if (lsi_add_device(devs, &count, names[i]->d_name) < 0)
+                    count = -1;
+                matched++;
+            }
+            free(names[i]);
+        }
+        free(names);
+        if (count < 0)
+            goto fail;
+        if (!matched) {
+            fprintf(stderr, "No SAS2008/2108 devices match %s\n", tok);
+            goto fail;
+        }
     }
-    fprintf(stderr, "I2C: SCL timeout!\n");
+
+    free(copy);
+    return count;
+
+fail:
+    free(copy);
     return -1;
 }
 
-static void i2c_stop(lsi_dev_t *d)
+// Replace every {} in arg with the PCI ID
+static char *lsi_subst_id(const char *arg, const char *id)
 {
-    i2c_delay(d);
-    set_sda(d, 0);
-    i2c_delay(d);
-    set_scl(d, 1);
-    i2c_delay(d);
-    set_sda(d, 1);
-    i2c_delay(d);
+    size_t len = strlen(arg) + 1;
+
+    for (const char *p = arg; (p = strstr(p, "{}")); p += 2)
+        len += strlen(id);
+
+    char *out = malloc(len);
+    char *o = out;
+    while (*arg) {
+        if (arg[0] == '{' && arg[1] == '}') {
+            o = stpcpy(o, id);
+            arg += 2;
+        } else {
+            *o++ = *arg++;
+        }
+    }
+    *o = 0;
+    return out;
 }
 
-static void i2c_start(lsi_dev_t *d)
+/*
+ * Write one JSON line for an operation: its outcome, result fields and phase
+ * timeline, with times in ms from the start of the operation.
+ */
+static void lsi_json_emit(lsi_dev_t *d, const char *op, int ret)
 {
-    i2c_delay(d);
-    set_sda(d, 1);
-    i2c_delay(d);
-    set_scl(d, 1);
-    i2c_delay(d);
-    wait_scl(d);
-    set_sda(d, 0);
-    i2c_delay(d);
-    set_scl(d, 0);
-    i2c_delay(d);
-}
+    lsi_json_t *j = d->json;
+    uint64_t end = lsi_now();
+    char line[8192], dev[sizeof(d->pci_id) + 16], opn[64];
+    int n = 0;
+
+#define JSON_OUT(...) \
+    n += snprintf(line + n, n < sizeof(line) ? sizeof(line) - n : 0, __VA_ARGS__)
+
+    JSON_OUT("{\"device\":%s,\"op\":%s,\"ok\":%s,\"mode\":\"%s\"",
+             lsi_json_escape(dev, sizeof(dev), d->pci_id),
+             lsi_json_escape(opn, sizeof(opn), op), ret ? "false" : "true",
+             d->mode == LSI_MODE_MEGARAID ? "MEGARAID" : "MPT");
+    for (int i = 0; i < j->nfields; i++)
+        JSON_OUT(",\"%s\":%s", j->field[i].key, j->field[i].val);
+    JSON_OUT(",\"total_ms\":%.3f,\"timeline\":[", (end - j->start) / 1e6);
+    for (int i = 0; i < j->nphases; i++) {
+        uint64_t next = i + 1 < j->nphases ? j->phase[i + 1].start : end;
+        JSON_OUT("%s{\"phase\":\"%s\",\"start_ms\":%.3f,\"ms\":%.3f}",
+                 i ? "," : "", j->phase[i].name,
+                 (j->phase[i].start - j->start) / 1e6,
+                 (next - j->phase[i].start) / 1e6);
+    }
+    JSON_OUT("]}\n");
 
-static void i2c_sendbit(lsi_dev_t *d, int bit)
-{
-    set_sda(d, bit);
-    i2c_delay(d);
-    set_scl(d, 1);
-    wait_scl(d);
-    i2c_delay(d);
-    set_scl(d, 0);
-    i2c_delay(d);
+#undef JSON_OUT
+
+    if (n >= sizeof(line)) {
+        fprintf(stderr, "JSON result too long\n");
+        return;
+    }
+    // One write per line, so lines from parallel workers do not interleave
+    if (write(opts.json_fd, line, n) != n)
+        perror("write json");
 }
 
-static int i2c_getbit(lsi_dev_t *d)
+static int lsi_run_op(lsi_dev_t *d, const lsi_op_t *op, int argc, char **argv)
 {
-    set_sda(d, 1);
-    i2c_delay(d);
-    set_scl(d, 1);
-    wait_scl(d);
-    i2c_delay(d);
-    int val = get_sda(d);
-    set_scl(d, 0);
-    i2c_delay(d);
-    return val;
+    // Counters are per operation, also when serve reuses the device
+    d->mmio_ops = d->mmio_saved = 0;
+    if (d->stats)
+        memset(d->stats, 0, sizeof(*d->stats));
+    if (d->json) {
+        memset(d->json, 0, sizeof(*d->json));
+        d->json->start = lsi_now();
+    }
+
+    int ret = op->fn(d, argc, argv);
+
+    if (d->stats)
+        lsi_print_stats(d);
+    if (d->json)
+        lsi_json_emit(d, op->name, ret);
+
+    return ret;
 }
 
-static void i2c_sendbyte(lsi_dev_t *d, uint8_t byte)
+// A reset locks the diag registers again
+static int lsi_ensure_unlocked(lsi_dev_t *d)
 {
-    for (int i = 0x80; i ; i >>= 1)
-        i2c_sendbit(d, byte & i);
+    if (read32(d, d->r_diag) & MPI2_DIAG_WRITE_ENABLE)
+        return 0;
+    return lsi_reopen(d);
 }
 
-static uint8_t i2c_getbyte(lsi_dev_t *d)
+/*
+ * Run a list of operations on one open device, stopping at the first
+ * failure. The I2C bus stays with us between consecutive SBR operations.
+ */
+static void lsi_inv_forget(const char *pci_id);
+
+static int lsi_run_steps(lsi_dev_t *d, const lsi_step_t *steps, int count)
 {
-    uint8_t val = 0;
-    for (int i = 0x80; i ; i >>= 1)
-        if (i2c_getbit(d))
-            val |= i;
-    return val;
+    int ret = 0;
+
+    for (int i = 0; i < count && !ret; i++) {
+        const lsi_step_t *step = &steps[i];
+
+        if (count > 1)
+            printf("[%d/%d] %s\n", i + 1, count, step->op->name);
+
+        if (i > 0 && (ret = lsi_ensure_unlocked(d)) < 0)
+            break;
+
+        d->i2c_keep = i + 1 < count && (step->op->flags & OP_I2C) &&
+                      (steps[i + 1].op->flags & OP_I2C);
+        ret = lsi_run_op(d, step->op, step->argc, step->argv);
+        if ((step->op->flags & OP_SBR_WRITE) && !d->emu)
+            lsi_inv_forget(d->pci_id);
+        if (ret)
+            fprintf(stderr, "%s failed, stopping\n", step->op->name);
+    }
+
+    // Also hand the bus back if an SBR operation bailed out early
+    d->i2c_keep = 0;
+    if (d->i2c_open)
+        lsi_i2c_close(d);
+
+    return ret;
 }
 
-static int lsi_i2c_init(lsi_dev_t *d)
+static int lsi_run_one(const char *id, const lsi_step_t *steps, int count)
 {
-    uint32_t val;
+    lsi_step_t subst[count];
+    lsi_dev_t dev;
 
-    val = dcr_read32(d, DCR_SBR_CONFIG);
-    if (val & 2) {
-        d->sbr_addr = 0x54;
-    } else {
-        d->sbr_addr = 0x50;
+    for (int i = 0; i < count; i++) {
+        subst[i] = steps[i];
+        subst[i].argv = malloc((steps[i].argc + 1) * sizeof(char *));
+        for (int j = 0; j < steps[i].argc; j++)
+            subst[i].argv[j] = lsi_subst_id(steps[i].argv[j], id);
     }
-    printf("Using I2C address 0x%02x\n", d->sbr_addr);
-    if (val & 8) {
-        d->eep_type = EEPROM_TYPE_16BIT;
-    } else {
-        d->eep_type = EEPROM_TYPE_8BIT;
+
+    if (lsi_open(id, &dev)) {
+        char j_dev[sizeof(dev.pci_id) + 16];
+
+        if (opts.json)
+            dprintf(opts.json_fd, "{\"device\":%s,\"op\":\"%s\",\"ok\":false,"
+                    "\"error\":\"open failed\"}\n",
+                    lsi_json_escape(j_dev, sizeof(j_dev), id), steps[0].op->name);
+        return 1;
     }
-    printf("Using EEPROM type %d\n", d->eep_type);
 
-    chip_write32(d, CHIP_I2C_RESET, 1);
-    do {
-        i2c_delay(d);
-    } while (chip_read32(d, CHIP_I2C_RESET) & 1);
+    return !!lsi_run_steps(&dev, subst, count);
+}
 
-    val = dcr_read32(d, DCR_I2C_SELECT);
-    val |= 0x800000;
-    dcr_write32(d, DCR_I2C_SELECT, val);
+typedef struct {
+    const char *id;
+    pid_t pid;
+    int fd[2];
+    char buf[2][1024];
+    int len[2];
+    int status;
+} lsi_worker_t;
+
+static void lsi_worker_flush(lsi_worker_t *w, int i, int all)
+{
+    FILE *out = i ? stderr : stdout;
+    char *start = w->buf[i];
+    char *nl;
 
-    // Make sure things are reset
-    for (int i = 0; i < 9; i++)
-        i2c_sendbit(d, 1);
-    i2c_stop(d);
-    i2c_start(d);
-    i2c_stop(d);
+    while ((nl = memchr(start, '\n', w->len[i] - (start - w->buf[i])))) {
+        fprintf(out, "[%s] %.*s\n", w->id, (int)(nl - start), start);
+        start = nl + 1;
+    }
+    w->len[i] -= start - w->buf[i];
+    memmove(w->buf[i], start, w->len[i]);
 
-    return 0;
+    if (w->len[i] && (all || w->len[i] == sizeof(w->buf[i]))) {
+        fprintf(out, "[%s] %.*s\n", w->id, w->len[i], w->buf[i]);
+        w->len[i] = 0;
+    }
+    fflush(out);
 }
 
-static int lsi_i2c_close(lsi_dev_t *d)
+/*
+ * Run an operation on several devices at once, one worker process per
+ * device. Worker output is collected through pipes and prefixed with the
+ * PCI ID, line by line.
+ */
+static int lsi_run_parallel(char **devs, int count, const lsi_step_t *steps,
+                            int nsteps)
 {
-    uint32_t val;
+    lsi_worker_t *workers = calloc(count, sizeof(*workers));
+    struct pollfd *pfds = calloc(2 * count, sizeof(*pfds));
+    int open_fds = 0, failed = 0, started;
 
-    chip_write32(d, CHIP_I2C_RESET, 1);
-    do {
-        i2c_delay(d);
-    } while (chip_read32(d, CHIP_I2C_RESET) & 1);
+    fflush(stdout);
+    fflush(stderr);
 
-    val = dcr_read32(d, DCR_I2C_SELECT);
-    val &= ~0x800000;
-    dcr_write32(d, DCR_I2C_SELECT, val);
+    // If a worker cannot be started, still wait for the ones already running
+    for (started = 0; started < count; started++) {
+        lsi_worker_t *w = &workers[started];
+        int out[2], err[2];
 
-    return 0;
-}
+        w->id = devs[started];
+        if (pipe(out) < 0) {
+            perror("pipe");
+            break;
+        }
+        if (pipe(err) < 0) {
+            perror("pipe");
+            close(out[0]);
+            close(out[1]);
+            break;
+        }
 
-static int lsi_i2c_read_sbr(lsi_dev_t *d, int offset, int len, uint8_t *buf)
-{
-    i2c_start(d);
-    i2c_sendbyte(d, (d->sbr_addr << 1) | 0);
-    if (i2c_getbit(d)) {
-        fprintf(stderr, "SBR read failed: EEPROM did not ACK address W\n");
-        return -1;
+        w->pid = fork();
+        if (w->pid < 0) {
+            perror("fork");
+            close(out[0]);
+            close(out[1]);
+            close(err[0]);
+            close(err[1]);
+            break;
+        }
+        if (!w->pid) {
+            dup2(out[1], 1);
+            dup2(err[1], 2);
+            close(out[0]);
+            close(out[1]);
+            close(err[0]);
+            close(err[1]);
+            setvbuf(stdout, NULL, _IOLBF, 0);
+            exit(lsi_run_one(w->id, steps, nsteps));
+        }
+
+        close(out[1]);
+        close(err[1]);
+        w->fd[0] = out[0];
+        w->fd[1] = err[0];
+        pfds[2 * started].fd = out[0];
+        pfds[2 * started].events = POLLIN;
+        pfds[2 * started + 1].fd = err[0];
+        pfds[2 * started + 1].events = POLLIN;
+        open_fds += 2;
     }
 
-    if (d->eep_type == EEPROM_TYPE_16BIT) {
-        i2c_sendbyte(d, offset >> 8);
-        if (i2c_getbit(d)) {
-            fprintf(stderr, "SBR read failed: EEPROM did not ACK offset1\n");
-            return -1;
+    while (open_fds) {
+        if (poll(pfds, 2 * started, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        for (int j = 0; j < 2 * started; j++) {
+            lsi_worker_t *w = &workers[j / 2];
+            int i = j % 2;
+
+            if (pfds[j].fd < 0 || !pfds[j].revents)
+                continue;
+
+            ssize_t ret = read(pfds[j].fd, w->buf[i] + w->len[i],
+                               sizeof(w->buf[i]) - w->len[i]);
+            if (ret > 0) {
+                w->len[i] += ret;
+                lsi_worker_flush(w, i, 0);
+            } else {
+                lsi_worker_flush(w, i, 1);
+                close(pfds[j].fd);
+                pfds[j].fd = -1;
+                open_fds--;
+            }
         }
     }
 
-    i2c_sendbyte(d, offset & 0xff);
-    if (i2c_getbit(d)) {
-        fprintf(stderr, "SBR read failed: EEPROM did not ACK offset0\n");
-        return -1;
-    }
+    printf("Summary:\n");
+    for (int i = 0; i < count; i++) {
+        lsi_worker_t *w = &workers[i];
 
-    i2c_start(d);
-    i2c_sendbyte(d, (d->sbr_addr << 1) | 1);
-    if (i2c_getbit(d)) {
-        fprintf(stderr, "SBR read failed: EEPROM did not ACK address R\n");
-        return -1;
+        if (i >= started) {
+            printf(" %s: NOT STARTED\n", devs[i]);
+            failed++;
+            continue;
+        }
+        waitpid(w->pid, &w->status, 0);
+        if (WIFEXITED(w->status) && !WEXITSTATUS(w->status)) {
+            printf(" %s: OK\n", w->id);
+        } else {
+            printf(" %s: FAILED\n", w->id);
+            failed++;
+        }
     }
 
-    for (int i = 0; i < len; i++)
-    {
-        buf[i] = i2c_getbyte(d);
-        i2c_sendbit(d, i == (len - 1));
-    }
+    free(pfds);
+    free(workers);
+    return !!failed;
+}
 
-    i2c_stop(d);
+// Device IDs of the SAS2008/2108 functions picked up by scan and globs
+static const uint16_t scan_device_ids[] = {
+    0x0072, // SAS2008 (MPT)
+    0x0073, // SAS2008 (MegaRAID)
+    0x0078, // SAS2108 (MegaRAID)
+    0x0079, // SAS2108 (MegaRAID)
+    0,
+};
+
+typedef struct {
+    char pci_id[16];
+    // vendor:device:subsystem_vendor:subsystem_device:revision, from sysfs
+    char identity[32];
+    // Read fresh on every scan, never cached
+    int mode;
+    uint32_t doorbell;
+    // Cached until the identity changes or lsirec writes the SBR
+    uint8_t sbr_addr;
+    int eep_type;
+    uint64_t sas_addr;
+    int cached;
+} lsi_inv_t;
+
+static int lsi_sysfs_read(const char *pci_id, const char *attr, char *buf,
+                          int len)
+{
+    char path[128];
+
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/%s", pci_id, attr);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    int ret = read(fd, buf, len - 1);
+    close(fd);
+    if (ret < 0)
+        return -1;
 
+    buf[ret] = 0;
+    buf[strcspn(buf, "\n")] = 0;
     return 0;
 }
 
-static int lsi_i2c_write_sbr(lsi_dev_t *d, int offset, int len, uint8_t *buf)
+static void lsi_sysfs_driver(const char *pci_id, char *buf, int len)
 {
-    for (int i = offset; i < (len + offset); i++)
-    {
-        i2c_start(d);
-        i2c_sendbyte(d, (d->sbr_addr << 1) | 0);
-        if (i2c_getbit(d)) {
-            fprintf(stderr, "SBR write failed: EEPROM did not ACK address W\n");
-            return -1;
-        }
+    char path[128], link[256];
 
-        if (d->eep_type == EEPROM_TYPE_16BIT) {
-            i2c_sendbyte(d, i >> 8);
-            if (i2c_getbit(d)) {
-                fprintf(stderr, "SBR write failed: EEPROM did not ACK offset1\n");
-                return -1;
-            }
-        }
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%.15s/driver", pci_id);
+    ssize_t ret = readlink(path, link, sizeof(link) - 1);
+    if (ret < 0) {
+        snprintf(buf, len, "-");
+        return;
+    }
+    link[ret] = 0;
 
-        i2c_sendbyte(d, i & 0xff);
-        if (i2c_getbit(d)) {
-            fprintf(stderr, "SBR write failed: EEPROM did not ACK offset0\n");
-            return -1;
-        }
+    char *base = strrchr(link, '/');
+    base = base ? base + 1 : link;
+    if (strlen(base) >= len)
+        base[len - 1] = 0;
+    strcpy(buf, base);
+}
 
-        i2c_sendbyte(d, buf[i]);
-        if (i2c_getbit(d)) {
-            fprintf(stderr, "SBR write failed: EEPROM did not ACK data\n");
+static int lsi_sysfs_identity(const char *pci_id, char *buf, int len,
+                              unsigned *vid, unsigned *pid)
+{
+    static const char *attrs[] = {
+        "vendor", "device", "subsystem_vendor", "subsystem_device", "revision",
+    };
+    unsigned val[5];
+    char tmp[16];
+
+    for (int i = 0; i < 5; i++) {
+        if (lsi_sysfs_read(pci_id, attrs[i], tmp, sizeof(tmp)) < 0)
             return -1;
-        }
-        i2c_stop(d);
-
-        usleep(5000);
+        val[i] = strtoul(tmp, NULL, 16);
     }
 
+    snprintf(buf, len, "%04x:%04x:%04x:%04x:%02x",
+             val[0], val[1], val[2], val[3], val[4]);
+    *vid = val[0];
+    *pid = val[1];
+    return 0;
+}
 
+static int lsi_supported_id(unsigned vid, unsigned pid)
+{
+    if (vid != 0x1000)
+        return 0;
+    for (const uint16_t *p = scan_device_ids; *p; p++)
+        if (*p == pid)
+            return 1;
     return 0;
 }
 
-static void print_ioc_state(lsi_dev_t *d)
+static int lsi_sysfs_supported(const char *pci_id)
 {
-    uint32_t doorbell = read32(d, MPI2_DOORBELL);
+    char vid[16], pid[16];
 
-    printf("IOC is ");
-    if (!(doorbell & MPI2_DOORBELL_STATE_MASK)) {
-        printf("RESET ");
+    if (lsi_sysfs_read(pci_id, "vendor", vid, sizeof(vid)) < 0 ||
+        lsi_sysfs_read(pci_id, "device", pid, sizeof(pid)) < 0)
+        return 0;
+    return lsi_supported_id(strtoul(vid, NULL, 16), strtoul(pid, NULL, 16));
+}
+
+// Serializes inventory updates from scan and from parallel SBR writes
+static int lsi_inv_lock(const char *path)
+{
+    char lock[256], dir[256];
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = 0;
+        mkdir(dir, 0755);
     }
-    if (doorbell & MPI2_DOORBELL_READY) {
-        printf("READY ");
+
+    snprintf(lock, sizeof(lock), "%s.lock", path);
+    int fd = open(lock, O_RDWR|O_CREAT, 0644);
+    if (fd >= 0 && flock(fd, LOCK_EX) < 0) {
+        close(fd);
+        fd = -1;
     }
-    if (doorbell & MPI2_DOORBELL_OPERATIONAL) {
-        printf("OPERATIONAL ");
+    return fd;
+}
+
+static int lsi_inv_load(const char *path, lsi_inv_t *inv, int max)
+{
+    char line[256];
+    int count = 0;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+
+    // Older inventories also cached the IOC state; start over
+    if (!fgets(line, sizeof(line), fp) ||
+        strcmp(line, "# lsirec inventory v2\n")) {
+        fclose(fp);
+        return 0;
     }
-    if (doorbell & MPI2_DOORBELL_FAULT) {
-        printf("FAULT ");
+
+    while (count < max && fgets(line, sizeof(line), fp)) {
+        lsi_inv_t *e = &inv[count];
+        unsigned sbr_addr;
+
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%15s %31s %x %d %" SCNx64, e->pci_id, e->identity,
+                   &sbr_addr, &e->eep_type, &e->sas_addr) != 5)
+            continue;
+        e->sbr_addr = sbr_addr;
+        count++;
     }
-    printf("\n");
+
+    fclose(fp);
+    return count;
 }
 
-static int do_info(lsi_dev_t *d)
+static int lsi_inv_save(const char *path, lsi_inv_t *inv, int count)
 {
-    printf("Registers:\n");
-    printf(" DOORBELL:       0x%08x\n", read32(d, MPI2_DOORBELL));
-    printf(" DIAG:           0x%08x\n", read32(d, d->r_diag));
-    printf(" DCR_I2C_SELECT: 0x%08x\n", dcr_read32(d, DCR_I2C_SELECT));
-    printf(" DCR_SBR_SELECT: 0x%08x\n", dcr_read32(d, DCR_SBR_CONFIG));
-    printf(" CHIP_I2C_PINS:  0x%08x\n", chip_read32(d, CHIP_I2C_PINS));
+    char tmp[256];
 
-    print_ioc_state(d);
+    // The directory was created by lsi_inv_lock
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        perror("open inventory");
+        return -1;
+    }
+
+    fprintf(fp, "# lsirec inventory v2\n");
+    fprintf(fp, "# pci_id identity sbr_addr eep_type sas_addr\n");
+    for (int i = 0; i < count; i++) {
+        lsi_inv_t *e = &inv[i];
+        fprintf(fp, "%s %s %02x %d %016" PRIx64 "\n", e->pci_id, e->identity,
+                e->sbr_addr, e->eep_type, e->sas_addr);
+    }
 
+    if (fclose(fp) < 0 || rename(tmp, path) < 0) {
+        perror("write inventory");
+        unlink(tmp);
+        return -1;
+    }
     return 0;
 }
 
-static int do_readsbr(lsi_dev_t *d, const char *filename)
+// Drop a device's entry after its SBR was written
+static void lsi_inv_forget(const char *pci_id)
 {
-    uint8_t sbr[256];
-    int ret;
+    lsi_inv_t inv[MAX_DEVICES];
+    int count, kept = 0;
 
-    ret = lsi_i2c_init(d);
-    if (ret < 0)
-        return ret;
+    int lock = lsi_inv_lock(INVENTORY_DEFAULT);
+    if (lock < 0)
+        return;
 
-    printf("Reading SBR...\n");
-    ret = lsi_i2c_read_sbr(d, 0, sizeof(sbr), sbr);
-    if (ret < 0)
-        return ret;
+    count = lsi_inv_load(INVENTORY_DEFAULT, inv, MAX_DEVICES);
+    for (int i = 0; i < count; i++)
+        if (strcmp(inv[i].pci_id, pci_id))
+            inv[kept++] = inv[i];
+    if (kept < count)
+        lsi_inv_save(INVENTORY_DEFAULT, inv, kept);
 
-    int fd = open(filename, O_CREAT|O_WRONLY|O_TRUNC, 0666);
-    ret = write(fd, sbr, sizeof(sbr));
-    if (ret != sizeof(sbr)) {
-        perror("write");
-        return -1;
+    close(lock);
+}
+
+/*
+ * Read the mode and IOC state, and with sbr set also the SBR EEPROM details,
+ * which is the slow part.
+ */
+static int lsi_inv_probe(lsi_inv_t *e, int sbr)
+{
+    lsi_dev_t dev;
+    uint8_t sas[8];
+    int ret = -1;
+
+    // The probe path is chatty; keep its progress output out of the table
+    opts.quiet = 1;
+
+    if (lsi_open(e->pci_id, &dev))
+        goto out;
+
+    e->mode = dev.mode;
+    e->doorbell = read32(&dev, MPI2_DOORBELL);
+
+    if (!sbr) {
+        ret = 0;
+    } else if (lsi_i2c_init(&dev) == 0) {
+        e->sbr_addr = dev.sbr_addr;
+        e->eep_type = dev.eep_type;
+        e->sas_addr = 0;
+        if (lsi_i2c_read_sbr(&dev, SBR_SAS_ADDR, sizeof(sas), sas) == 0)
+            for (int i = 0; i < 8; i++)
+                e->sas_addr = (e->sas_addr << 8) | sas[i];
+        lsi_i2c_close(&dev);
+        ret = 0;
     }
-    close(fd);
-    printf("SBR saved to %s\n", filename);
 
-    lsi_i2c_close(d);
-    return 0;
+    lsi_close(&dev);
+
+out:
+    opts.quiet = 0;
+    return ret;
 }
 
-static int do_writesbr(lsi_dev_t *d, const char *filename)
+static int do_scan(int argc, char **argv)
 {
-    uint8_t sbr[256];
-    int ret;
+    const char *path = argc ? argv[0] : INVENTORY_DEFAULT;
+    lsi_inv_t cache[MAX_DEVICES], inv[MAX_DEVICES];
+    struct dirent **names;
+    int ncache = 0, count = 0, probed = 0, failed = 0;
+
+    int lock = lsi_inv_lock(path);
+    if (!opts.reprobe)
+        ncache = lsi_inv_load(path, cache, MAX_DEVICES);
+
+    int n = scandir("/sys/bus/pci/devices", &names, NULL, alphasort);
+    if (n < 0) {
+        perror("scandir /sys/bus/pci/devices");
+        if (lock >= 0)
+            close(lock);
+        return -1;
+    }
 
-    ret = lsi_i2c_init(d);
-    if (ret < 0)
-        return ret;
+    for (int i = 0; i < n; i++) {
+        const char *id = names[i]->d_name;
+        lsi_inv_t *e = &inv[count];
+        unsigned vid, pid;
+
+        if (id[0] == '.' || count >= MAX_DEVICES || strlen(id) > 15)
+            continue;
+
+        memset(e, 0, sizeof(*e));
+        strcpy(e->pci_id, id);
+        if (lsi_sysfs_identity(id, e->identity, sizeof(e->identity),
+                               &vid, &pid) < 0)
+            continue;
+        if (!lsi_supported_id(vid, pid))
+            continue;
+
+        for (int j = 0; j < ncache; j++) {
+            if (!strcmp(cache[j].pci_id, id) &&
+                !strcmp(cache[j].identity, e->identity)) {
+                *e = cache[j];
+                e->cached = 1;
+                break;
+            }
+        }
 
-    int fd = open(filename, O_RDONLY);
-    ret = read(fd, sbr, sizeof(sbr));
-    if (ret != sizeof(sbr)) {
-        perror("read");
-        return -1;
+        if (lsi_inv_probe(e, !e->cached) < 0) {
+            fprintf(stderr, "%s: probe failed\n", id);
+            failed++;
+            continue;
+        }
+        if (!e->cached)
+            probed++;
+        count++;
     }
-    close(fd);
 
-    printf("Writing SBR...\n");
-    ret = lsi_i2c_write_sbr(d, 0, sizeof(sbr), sbr);
-    if (ret < 0)
-        return ret;
-    printf("SBR written from %s\n", filename);
+    for (int i = 0; i < n; i++)
+        free(names[i]);
+    free(names);
+
+    printf("%-13s %-24s %-8s %-11s %-9s %-10s %-18s\n", "PCI ID",
+           "VID:PID:SVID:SPID:REV", "Mode", "IOC", "Driver", "SBR",
+           "SAS Address");
+    for (int i = 0; i < count; i++) {
+        lsi_inv_t *e = &inv[i];
+        char driver[32], sbr[16], sas[20];
+        char j_dev[64], j_ident[64], j_driver[80];
+
+        lsi_sysfs_driver(e->pci_id, driver, sizeof(driver));
+        snprintf(sbr, sizeof(sbr), "0x%02x/%s", e->sbr_addr,
+                 e->eep_type == EEPROM_TYPE_16BIT ? "16bit" : "8bit");
+        if (e->sas_addr)
+            snprintf(sas, sizeof(sas), "0x%016" PRIx64, e->sas_addr);
+        else
+            snprintf(sas, sizeof(sas), "-");
+
+        printf("%-13s %-24s %-8s %-11s %-9s %-10s %-18s%s\n", e->pci_id,
+               e->identity, e->mode == LSI_MODE_MEGARAID ? "MEGARAID" : "MPT",
+               ioc_state_name(e->doorbell), driver, sbr, sas,
+               e->cached ? " (cached)" : "");
+        if (opts.json)
+            dprintf(opts.json_fd, "{\"device\":%s,\"op\":\"scan\","
+                    "\"ok\":true,\"identity\":%s,\"mode\":\"%s\","
+                    "\"doorbell\":\"0x%08x\",\"ioc_state\":\"%s\","
+                    "\"driver\":%s,\"sbr_addr\":%d,\"eep_type\":\"%s\","
+                    "\"sas_addr\":\"0x%016" PRIx64 "\",\"cached\":%s}\n",
+                    lsi_json_escape(j_dev, sizeof(j_dev), e->pci_id),
+                    lsi_json_escape(j_ident, sizeof(j_ident), e->identity),
+                    e->mode == LSI_MODE_MEGARAID ? "MEGARAID" : "MPT",
+                    e->doorbell, ioc_state_name(e->doorbell),
+                    lsi_json_escape(j_driver, sizeof(j_driver), driver),
+                    e->sbr_addr,
+                    e->eep_type == EEPROM_TYPE_16BIT ? "16bit" : "8bit",
+                    e->sas_addr, e->cached ? "true" : "false");
+    }
+    printf("%d adapters, %d probed, %d from cache\n", count, probed,
+           count - probed);
 
-    lsi_i2c_close(d);
-    return 0;
+    int ret = lsi_inv_save(path, inv, count);
+    if (lock >= 0)
+        close(lock);
+
+    return ret < 0 || failed ? -1 : 0;
 }
 
-static int do_reset(lsi_dev_t *d)
+#define SERVE_MAX_REQUEST       4096
+#define SERVE_MAX_ARGS          64
+#define SERVE_READ_TIMEOUT_S    5
+// Clients whose request line has not fully arrived yet
+#define SERVE_MAX_PENDING       16
+
+// Pass a request line and the client socket to a device worker
+static int serve_send(int sock, const char *req, int fd)
 {
-    int ret;
-    uint32_t val;
+    struct iovec iov = { (void *)req, strlen(req) };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctl.buf,
+        .msg_controllen = sizeof(ctl.buf),
+    };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, 0) < 0 ? -1 : 0;
+}
 
-    ret = lsi_unbind_driver(d);
-    if (ret < 0)
-        return ret;
+static int serve_recv(int sock, char *req, int len, int *fd)
+{
+    struct iovec iov = { req, len - 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctl.buf,
+        .msg_controllen = sizeof(ctl.buf),
+    };
+    ssize_t ret;
 
-    printf("Resetting adapter...\n");
-    val = read32(d, d->r_diag);
-    val &= ~MPI2_DIAG_BOOTDEVICE_MASK;
-    val &= ~MPI2_DIAG_FORCE_HCB;
-    val &= ~MPI2_DIAG_HCB_MODE;
-    write32(d, d->r_diag, val);
+    do {
+        ret = recvmsg(sock, &msg, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0)
+        return -1;
 
-    usleep(100000);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (!c || c->cmsg_type != SCM_RIGHTS)
+        return -1;
+    memcpy(fd, CMSG_DATA(c), sizeof(int));
+    req[ret] = 0;
+    return 0;
+}
 
-    val = read32(d, d->r_diag);
-    val |= MPI2_DIAG_RESET_ADAPTER;
-    write32(d, d->r_diag, val);
+static int lsi_serve_request(lsi_dev_t *d, const char *id, int *is_open,
+                             char *req)
+{
+    char *argv[SERVE_MAX_ARGS];
+    lsi_step_t steps[MAX_STEPS];
+    char *save, *tok;
+    int argc = 0;
 
-    usleep(100000);
-    print_ioc_state(d);
+    for (tok = strtok_r(req, " \t\r\n", &save); tok && argc < SERVE_MAX_ARGS;
+         tok = strtok_r(NULL, " \t\r\n", &save))
+        argv[argc++] = tok;
 
-    for (int i = 0; i < 200; i++) {
-        if (read32(d, MPI2_DOORBELL) & MPI2_DOORBELL_READY)
-            break;
-        usleep(10000);
+    int count = lsi_parse_steps(argc, argv, steps);
+    if (count <= 0)
+        return 1;
+    for (int i = 0; i < count; i++) {
+        if (steps[i].op->flags & OP_RELEASES) {
+            fprintf(stderr, "%s is not available in serve mode\n",
+                    steps[i].op->name);
+            return 1;
+        }
+        // Data and messages would be mixed on the one client socket
+        if ((steps[i].op->flags & OP_OUTPUT_FILE) &&
+            !strcmp(steps[i].argv[0], "-")) {
+            fprintf(stderr, "%s to - is not available in serve mode\n",
+                    steps[i].op->name);
+            return 1;
+        }
     }
 
-    print_ioc_state(d);
-
-    if (!(read32(d, MPI2_DOORBELL) & MPI2_DOORBELL_READY)) {
-        printf("IOC failed to become ready\n");
-        return -1;
+    if (!*is_open) {
+        if (lsi_open(id, d))
+            return 1;
+        *is_open = 1;
+    } else {
+        // Another process (e.g. lsirec watch) may have moved the RW window
+        lsi_invalidate_cache(d);
+        if (lsi_ensure_unlocked(d) < 0)
+            return 1;
     }
 
-    return 0;
+    return !!lsi_run_steps(d, steps, count);
 }
 
-static int do_halt(lsi_dev_t *d)
+/*
+ * Device worker: keeps the device open and unlocked, and runs one request at
+ * a time with its output going straight to the client.
+ */
+static void lsi_serve_worker(const char *id, int sock)
 {
-    int ret;
-    uint32_t val;
+    char req[SERVE_MAX_REQUEST];
+    lsi_dev_t dev;
+    int is_open = 0, client;
 
-    ret = lsi_unbind_driver(d);
-    if (ret < 0)
-        return ret;
+    // Keep stdout and stderr lines in order on the client socket
+    setvbuf(stdout, NULL, _IOLBF, 0);
 
-    printf("Resetting adapter in HCB mode...\n");
-    val = read32(d, d->r_diag);
-    val |= MPI2_DIAG_FORCE_HCB;
-    write32(d, d->r_diag, val);
-    val |= MPI2_DIAG_RESET_ADAPTER;
-    write32(d, d->r_diag, val);
+    if (lsi_open(id, &dev) == 0)
+        is_open = 1;
+    else
+        fprintf(stderr, "%s: open failed, will retry on request\n", id);
+    fflush(stdout);
+
+    while (!serve_recv(sock, req, sizeof(req), &client)) {
+        int out = dup(1), err = dup(2);
+
+        dup2(client, 1);
+        dup2(client, 2);
+        int ret = lsi_serve_request(&dev, id, &is_open, req);
+        fflush(stdout);
+        fflush(stderr);
+        dup2(out, 1);
+        dup2(err, 2);
+        close(out);
+        close(err);
+
+        dprintf(client, "EXIT %d\n", ret);
+        close(client);
+    }
 
-    usleep(1000000);
+    if (is_open)
+        lsi_close(&dev);
+    exit(0);
+}
 
-    lsi_reopen(d);
+typedef struct {
+    int fd;
+    int len;
+    uint64_t deadline;
+    char req[SERVE_MAX_REQUEST];
+} lsi_pending_t;
+
+// Hand a complete request line to the worker for its device
+static void lsi_serve_dispatch(int client, char *req, char **devs, int *socks,
+                               int count)
+{
+    req[strcspn(req, "\n")] = 0;
+    // The worker writes the output with ordinary blocking writes
+    fcntl(client, F_SETFL, 0);
+
+    char *rest = req + strcspn(req, " \t");
+    if (*rest)
+        *rest++ = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (strcmp(devs[i], req))
+            continue;
+        if (socks[i] < 0 || serve_send(socks[i], rest, client) < 0)
+            dprintf(client, "Worker for %s is not running\nEXIT 1\n", req);
+        return;
+    }
+    dprintf(client, "Unknown device: %s\nEXIT 1\n", req);
+}
 
-    val = read32(d, d->r_diag);
-    val &= ~MPI2_DIAG_FORCE_HCB;
-    write32(d, d->r_diag, val);
+// Only the user the server runs as (normally root) may send requests
+static int lsi_serve_allowed(int client)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
 
-    print_ioc_state(d);
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return 0;
+    return cred.uid == geteuid();
+}
 
-    if (read32(d, MPI2_DOORBELL) & MPI2_DOORBELL_STATE_MASK) {
-        printf("IOC failed to stay in reset\n");
-        return -1;
-    }
+/*
+ * Read more of a pending request. Returns 1 once it is complete (or the
+ * client gave up), 0 while more is expected.
+ */
+static int lsi_serve_read(lsi_pending_t *p)
+{
+    ssize_t ret = read(p->fd, p->req + p->len, sizeof(p->req) - 1 - p->len);
 
-    return 0;
+    if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+        return 0;
+    if (ret > 0)
+        p->len += ret;
+    p->req[p->len] = 0;
+    return ret <= 0 || memchr(p->req, '\n', p->len) ||
+           p->len == sizeof(p->req) - 1;
 }
 
-static int do_hostboot(lsi_dev_t *d, const char *filename)
+static int do_serve(char **devs, int count, const char *path)
 {
-    int ret;
-    uint32_t val;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct sigaction sa = { .sa_handler = lsi_signal };
+    int socks[MAX_DEVICES];
+    pid_t pids[MAX_DEVICES];
 
-    ret = do_halt(d);
-    if (ret < 0)
-        return ret;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
 
-    val = read32(d, d->r_diag);
-    val |= MPI2_DIAG_CLR_FLASH_BAD_SIG;
-    val &= ~MPI2_DIAG_BOOTDEVICE_MASK;
-    val &= ~MPI2_DIAG_FORCE_HCB;
-    val &= ~MPI2_DIAG_RESET_HISTORY;
-    write32(d, d->r_diag, val);
+    // Clients may go away before their output is written
+    signal(SIGPIPE, SIG_IGN);
+    fflush(stdout);
+    fflush(stderr);
 
-    ret = lsi_setup_hcdw(d);
-    if (ret < 0) {
-        return ret;
+    for (int i = 0; i < count; i++) {
+        int sv[2];
+
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+            perror("socketpair");
+            return -1;
+        }
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            perror("fork");
+            return -1;
+        }
+        if (!pids[i]) {
+            for (int j = 0; j < i; j++)
+                close(socks[j]);
+            close(sv[0]);
+            lsi_serve_worker(devs[i], sv[1]);
+        }
+        close(sv[1]);
+        socks[i] = sv[0];
     }
 
-    printf("Loading firmware...\n");
-    memset(d->hcdw, 0x42, HCDW_SIZE);
-    int fd = open(filename, O_RDONLY);
-    if (fd < 0) {
-        perror("open firmware");
-        return fd;
+    int ls = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ls < 0) {
+        perror("socket");
+        return -1;
     }
-    ssize_t length = read(fd, d->hcdw, HCDW_SIZE);
-    if (length < 0) {
-        perror("read firmware");
-        return length;
+    unlink(path);
+    // Requests run as root, so only root may even connect
+    mode_t mask = umask(077);
+    int ret = bind(ls, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (ret < 0 || listen(ls, 16) < 0) {
+        perror("bind");
+        close(ls);
+        return -1;
     }
-    memmove(d->hcdw + HCDW_SIZE - length, d->hcdw, length);
-    printf("Loaded %ld bytes\n", length);
-
-    val = read32(d, d->r_diag);
-    val |= MPI2_DIAG_BOOTDEVICE_HCDW;
-    write32(d, d->r_diag, val);
-
-    printf("Booting IOC...\n");
 
-    val &= ~MPI2_DIAG_HOLD_IOC_RESET;
-    val &= ~MPI2_DIAG_FORCE_HCB;
-    write32(d, d->r_diag, val);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("Serving %d device%s on %s\n", count, count > 1 ? "s" : "", path);
+    fflush(stdout);
+
+    /*
+     * Request lines are collected from all connected clients at once, so a
+     * slow one cannot hold up the others.
+     */
+    lsi_pending_t pending[SERVE_MAX_PENDING];
+    struct pollfd pfds[SERVE_MAX_PENDING + 1];
+    int npending = 0;
+
+    while (!lsi_quit) {
+        uint64_t now = lsi_now();
+        int timeout = -1;
+
+        pfds[0].fd = ls;
+        pfds[0].events = POLLIN;
+        for (int i = 0; i < npending; i++) {
+            int ms = (pending[i].deadline - now) / 1000000 + 1;
+            if (pending[i].deadline <= now)
+                ms = 0;
+            if (timeout < 0 || ms < timeout)
+                timeout = ms;
+            pfds[i + 1].fd = pending[i].fd;
+            pfds[i + 1].events = POLLIN;
+        }
 
-    for (int i = 0; i < 200; i++) {
-        if (read32(d, MPI2_DOORBELL) & MPI2_DOORBELL_READY)
+        if (poll(pfds, npending + 1, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
             break;
-        usleep(10000);
-    }
+        }
 
-    print_ioc_state(d);
+        now = lsi_now();
+        for (int i = npending - 1; i >= 0; i--) {
+            lsi_pending_t *p = &pending[i];
 
-    if (!(read32(d, MPI2_DOORBELL) & MPI2_DOORBELL_READY)) {
-        printf("IOC failed to become ready\n");
-        return -1;
-    }
+            if (pfds[i + 1].revents && lsi_serve_read(p)) {
+                lsi_serve_dispatch(p->fd, p->req, devs, socks, count);
+            } else if (p->deadline <= now) {
+                dprintf(p->fd, "Timed out waiting for the request\nEXIT 1\n");
+            } else {
+                continue;
+            }
+            close(p->fd);
+            *p = pending[--npending];
+        }
 
-    usleep(500000);
+        if (!(pfds[0].revents & POLLIN))
+            continue;
+        int client = accept4(ls, NULL, NULL, SOCK_NONBLOCK);
+        if (client < 0) {
+            if (errno != EINTR && errno != EAGAIN)
+                perror("accept");
+            continue;
+        }
+        if (!lsi_serve_allowed(client)) {
+            dprintf(client, "Permission denied\nEXIT 1\n");
+            close(client);
+        } else if (npending == SERVE_MAX_PENDING) {
+            dprintf(client, "Server busy\nEXIT 1\n");
+            close(client);
+        } else {
+            pending[npending].fd = client;
+            pending[npending].len = 0;
+            pending[npending].deadline = now + SERVE_READ_TIMEOUT_S * 1000000000ULL;
+            npending++;
+        }
+    }
 
-    printf("IOC Host Boot successful.\n");
+    for (int i = 0; i < npending; i++)
+        close(pending[i].fd);
+    close(ls);
+    unlink(path);
 
-    lsi_disable_hcdw(d);
+    // Workers exit once their socket is closed
+    for (int i = 0; i < count; i++)
+        close(socks[i]);
+    for (int i = 0; i < count; i++)
+        waitpid(pids[i], NULL, 0);
 
     return 0;
 }
 
-static int do_unbind(lsi_dev_t *d)
+/*
+ * Send a request to a serve instance and relay its output. The last line is
+ * the operation's exit status.
+ */
+static int lsi_connect(const char *path, int argc, char **argv)
 {
-    return lsi_unbind_driver(d);
-}
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char buf[SERVE_MAX_REQUEST], held[32] = "";
+    int len = 0, status = 1;
 
-static int do_rescan(lsi_dev_t *d)
-{
-    int ret;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
 
-    ret = lsi_unbind_driver(d);
-    if (ret < 0)
-        return ret;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        return 1;
+    }
 
-    return lsi_rescan(d);
+    // A refused request is answered before it has been read
+    signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < argc; i++)
+        dprintf(fd, "%s%s", argv[i], i == argc - 1 ? "\n" : " ");
+
+    for (;;) {
+        ssize_t ret = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        len += ret;
+
+        // Only the very last line is the status, so hold back any "EXIT"
+        // line until it is clear whether more output follows
+        char *start = buf, *nl;
+        while ((nl = memchr(start, '\n', len - (start - buf)))) {
+            int n = nl + 1 - start;
+
+            fputs(held, stdout);
+            held[0] = 0;
+            if (!strncmp(start, "EXIT ", 5) && n < sizeof(held)) {
+                memcpy(held, start, n);
+                held[n] = 0;
+            } else {
+                fwrite(start, 1, n, stdout);
+            }
+            start = nl + 1;
+        }
+        len -= start - buf;
+        memmove(buf, start, len);
+        if (len == sizeof(buf) - 1) {
+            fputs(held, stdout);
+            held[0] = 0;
+            fwrite(buf, 1, len, stdout);
+            len = 0;
+        }
+    }
+    if (len) {
+        fputs(held, stdout);
+        held[0] = 0;
+        fwrite(buf, 1, len, stdout);
+    }
+    if (held[0])
+        status = atoi(held + 5);
+
+    close(fd);
+    return status;
 }
 
 static void usage(char *argv0)
 {
-    fprintf(stderr, "Usage: %s <PCI ID> <operation> [args...]\n", argv0);
+    fprintf(stderr, "Usage: %s [options] <PCI ID> <operation> [args...]\n", argv0);
     fprintf(stderr, "\n");
     fprintf(stderr, "PCI ID example: 0000:01:00.0\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "PCI ID \"emu[:eeprom.bin]\" (or \"emu-mr\" for MegaRAID mode)\n");
+    fprintf(stderr, "selects a software model of a SAS2008, for testing.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Several operations may be chained with \"+\" (e.g.\n");
+    fprintf(stderr, "\"halt + writesbr sbr.bin + reset\"), or read from a file\n");
+    fprintf(stderr, "with \"script <file>\" (one per line). They run on the\n");
+    fprintf(stderr, "same open device and stop at the first failure.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Several devices may be given as a comma-separated list\n");
+    fprintf(stderr, "and/or a glob (e.g. '0000:0[1-4]:00.0'). The operation\n");
+    fprintf(stderr, "then runs on all of them in parallel, and {} in file\n");
+    fprintf(stderr, "arguments is replaced with each device's PCI ID.\n");
+    fprintf(stderr, "A hostboot image shared by all devices is loaded and\n");
+    fprintf(stderr, "checked once, and every adapter boots from that copy.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --i2c-speed <Hz>\n");
+    fprintf(stderr, "    Target I2C bus speed for SBR access (default %d).\n",
+            I2C_SPEED_DEFAULT);
+    fprintf(stderr, "    Suffixes k and M are accepted, e.g. 400k.\n");
+    fprintf(stderr, "  --page-size <bytes>\n");
+    fprintf(stderr, "    EEPROM page write size (default %d for 8-bit, %d for\n",
+            EEPROM_PAGE_8BIT, EEPROM_PAGE_16BIT);
+    fprintf(stderr, "    16-bit addressed EEPROMs). Use 1 for byte writes.\n");
+    fprintf(stderr, "  --eeprom-size <bytes>\n");
+    fprintf(stderr, "    Size of a 16-bit addressed EEPROM, instead of\n");
+    fprintf(stderr, "    detecting it. Needed to write past 0x%x on a blank\n",
+            EEPROM_MIN_SIZE_16BIT);
+    fprintf(stderr, "    part, whose size cannot be detected.\n");
+    fprintf(stderr, "  --no-verify\n");
+    fprintf(stderr, "    Do not read back and verify after SBR writes.\n");
+    fprintf(stderr, "  --vfio\n");
+    fprintf(stderr, "    Access the device through vfio-pci (binding it if\n");
+    fprintf(stderr, "    needed) instead of sysfs. Host boot DMA then goes\n");
+    fprintf(stderr, "    through the IOMMU and needs no hugepages. Only for\n");
+    fprintf(stderr, "    runs with a * operation, which unbind the driver.\n");
+    fprintf(stderr, "  --timeout <ms>\n");
+    fprintf(stderr, "    How long to wait for the IOC after a reset or boot\n");
+    fprintf(stderr, "    (default %d).\n", IOC_TIMEOUT_DEFAULT);
+    fprintf(stderr, "  --stats\n");
+    fprintf(stderr, "    Count register accesses and time MMIO reads and I2C\n");
+    fprintf(stderr, "    phases, and print a summary at the end.\n");
+    fprintf(stderr, "  --force\n");
+    fprintf(stderr, "    Host boot firmware images that fail the header and\n");
+    fprintf(stderr, "    checksum checks.\n");
+    fprintf(stderr, "  --fw-cache[=<dir>]\n");
+    fprintf(stderr, "    Keep host boot images staged in files under <dir>\n");
+    fprintf(stderr, "    (default %s), so later runs with\n", FW_CACHE_DIR);
+    fprintf(stderr, "    the same image reuse them instead of loading again.\n");
+    fprintf(stderr, "  --json\n");
+    fprintf(stderr, "    Print one JSON line per operation (and per scanned\n");
+    fprintf(stderr, "    adapter) to stdout, with results and a timeline of\n");
+    fprintf(stderr, "    its phases. Messages go to stderr.\n");
+    fprintf(stderr, "  --connect <socket>\n");
+    fprintf(stderr, "    Run the operation through a serve instance.\n");
+    fprintf(stderr, "  --realtime\n");
+    fprintf(stderr, "    Run with SCHED_FIFO priority and locked memory, so\n");
+    fprintf(stderr, "    preemption does not stretch the I2C clock.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "       %s [options] scan [inventory file]\n", argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "scan lists the SAS2008/2108 adapters in the system\n");
+    fprintf(stderr, "with their current mode and IOC state. The SBR EEPROM\n");
+    fprintf(stderr, "details and SAS address are cached in the inventory\n");
+    fprintf(stderr, "file (default %s) and are not read\n", INVENTORY_DEFAULT);
+    fprintf(stderr, "again while the sysfs IDs are unchanged, until lsirec\n");
+    fprintf(stderr, "writes that device's SBR or --reprobe is given.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "       %s [options] <PCI IDs> serve <socket>\n", argv0);
+    fprintf(stderr, "       %s --connect <socket> <PCI ID> <operation> [args...]\n",
+            argv0);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "serve keeps the given devices open and unlocked, and runs\n");
+    fprintf(stderr, "operations sent to the Unix socket: one request line of\n");
+    fprintf(stderr, "\"<PCI ID> <operation> [args...]\" per connection, answered\n");
+    fprintf(stderr, "with the output and a final \"EXIT <status>\" line. Each\n");
+    fprintf(stderr, "device runs one request at a time, devices in parallel.\n");
+    fprintf(stderr, "File names are opened by the server. --connect sends a\n");
+    fprintf(stderr, "request and exits with its status.\n");
+    fprintf(stderr, "\n");
     fprintf(stderr, "Supported operations:\n");
     fprintf(stderr, "  info\n");
     fprintf(stderr, "    Print the device state and registers\n");
-    fprintf(stderr, "  readsbr <sbr.bin>\n");
+    fprintf(stderr, "  readsbr <sbr.bin|->\n");
     fprintf(stderr, "    Read the SBR.\n");
     fprintf(stderr, "  writesbr <sbr.bin>\n");
     fprintf(stderr, "    Write the SBR.\n");
+    fprintf(stderr, "  patchsbr <FIELD=VALUE>...\n");
+    fprintf(stderr, "    Change SBR fields in place (field names as used by\n");
+    fprintf(stderr, "    sbrtool.py, including SASAddr). Only the bytes that\n");
+    fprintf(stderr, "    change are written.\n");
+    fprintf(stderr, "  readeeprom <file|-> [offset [length]]\n");
+    fprintf(stderr, "    Dump the whole SBR EEPROM (size detected for 16-bit\n");
+    fprintf(stderr, "    addressed parts) or the given range.\n");
+    fprintf(stderr, "  writeeeprom <file|-> [offset]\n");
+    fprintf(stderr, "    Write a file to the EEPROM at offset (default 0).\n");
+    fprintf(stderr, "  peek <addr> [count]\n");
+    fprintf(stderr, "    Read 32-bit words of chip memory through the diag\n");
+    fprintf(stderr, "    window.\n");
+    fprintf(stderr, "  poke <addr> <value> [readback]\n");
+    fprintf(stderr, "    Write a 32-bit word of chip memory, and optionally\n");
+    fprintf(stderr, "    read it back.\n");
+    fprintf(stderr, "  dump <file|-> <addr> <length>\n");
+    fprintf(stderr, "    Save a range of chip memory, e.g. from a faulted IOC\n");
+    fprintf(stderr, "    before resetting it.\n");
+    fprintf(stderr, "  watch <file|-> <ms> <interval us> [reg...]\n");
+    fprintf(stderr, "    Sample registers every interval (0 = flat out) for\n");
+    fprintf(stderr, "    ms (0 = until interrupted) and save their changes as\n");
+    fprintf(stderr, "    a trace for watchtool.py. Registers are doorbell,\n");
+    fprintf(stderr, "    diag, hcdw_size, i2c_select, sbr_config, i2c_pins or\n");
+    fprintf(stderr, "    bar:/dcr:/chip:<addr>; default all of info's.\n");
     fprintf(stderr, " *reset\n");
     fprintf(stderr, "    Perform a normal adapter reset. This also reloads\n");
     fprintf(stderr, "    the SBR.\n");
@@ -896,13 +5726,18 @@ static void usage(char *argv0)
     fprintf(stderr, " *hostboot <firmware.bin>\n");
     fprintf(stderr, "    Reset the adapter and boot the specified firmware\n");
     fprintf(stderr, "    directly from host memory. Note: requires HugeTLB\n");
-    fprintf(stderr, "    and is not compatible with IOMMUs.\n");
+    fprintf(stderr, "    and an inactive IOMMU, unless --vfio is used.\n");
     fprintf(stderr, " *unbind\n");
     fprintf(stderr, "    Unbind the kernel driver from the PCI device.\n");
     fprintf(stderr, " *rescan\n");
     fprintf(stderr, "    Tell the kernel to remove and rescan the PCI device.\n");
     fprintf(stderr, "    This automatically picks up VID/PID changes and\n");
     fprintf(stderr, "    rebinds the driver.\n");
+    fprintf(stderr, "  bench [pattern]\n");
+    fprintf(stderr, "    Run microbenchmarks of register access, I2C and host\n");
+    fprintf(stderr, "    boot staging (only those matching the pattern), and\n");
+    fprintf(stderr, "    print BENCH lines. The write benchmarks only run\n");
+    fprintf(stderr, "    on the emulator.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "* Operation forcefully unbinds the kernel driver. Make\n");
     fprintf(stderr, "  sure your disks are not in use!\n");
@@ -911,37 +5746,243 @@ static void usage(char *argv0)
     fprintf(stderr, "\n");
 }
 
+static int parse_speed(const char *arg)
+{
+    char *end;
+    long val = strtol(arg, &end, 0);
+
+    if (*end == 'k' || *end == 'K') {
+        val *= 1000;
+        end++;
+    } else if (*end == 'M') {
+        val *= 1000000;
+        end++;
+    }
+    if (*end || val < 1000 || val > 1000000)
+        return -1;
+
+    return val;
+}
+
+static int lsi_go_realtime(void)
+{
+    struct sched_param param = {
+        .sched_priority = sched_get_priority_max(SCHED_FIFO) / 2,
+    };
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        perror("mlockall");
+        return -1;
+    }
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+        perror("sched_setscheduler");
+        return -1;
+    }
+    return 0;
+}
+
+enum {
+    OPT_I2C_SPEED = 0x100,
+    OPT_REALTIME,
+    OPT_PAGE_SIZE,
+    OPT_NO_VERIFY,
+    OPT_REPROBE,
+    OPT_TIMEOUT,
+    OPT_VFIO,
+    OPT_STATS,
+    OPT_CONNECT,
+    OPT_FORCE,
+    OPT_JSON,
+    OPT_FW_CACHE,
+    OPT_EEPROM_SIZE,
+};
+
+static const struct option long_opts[] = {
+    { "i2c-speed", required_argument, NULL, OPT_I2C_SPEED },
+    { "realtime", no_argument, NULL, OPT_REALTIME },
+    { "page-size", required_argument, NULL, OPT_PAGE_SIZE },
+    { "no-verify", no_argument, NULL, OPT_NO_VERIFY },
+    { "reprobe", no_argument, NULL, OPT_REPROBE },
+    { "timeout", required_argument, NULL, OPT_TIMEOUT },
+    { "vfio", no_argument, NULL, OPT_VFIO },
+    { "stats", no_argument, NULL, OPT_STATS },
+    { "connect", required_argument, NULL, OPT_CONNECT },
+    { "force", no_argument, NULL, OPT_FORCE },
+    { "json", no_argument, NULL, OPT_JSON },
+    { "fw-cache", optional_argument, NULL, OPT_FW_CACHE },
+    { "eeprom-size", required_argument, NULL, OPT_EEPROM_SIZE },
+    { NULL, 0, NULL, 0 },
+};
+
 int main(int argc, char **argv)
 {
-    if (argc < 3) {
-        usage(argv[0]);
+    char *argv0 = argv[0];
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "+", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case OPT_I2C_SPEED:
+            opts.i2c_speed = parse_speed(optarg);
+            if (opts.i2c_speed < 0) {
+                fprintf(stderr, "Invalid I2C speed: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_REALTIME:
+            opts.realtime = 1;
+            break;
+        case OPT_PAGE_SIZE:
+            opts.page_size = atoi(optarg);
+            if (opts.page_size < 1 || opts.page_size > 256 ||
+                (opts.page_size & (opts.page_size - 1))) {
+                fprintf(stderr, "Invalid page size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_EEPROM_SIZE:
+            opts.eeprom_size = strtol(optarg, NULL, 0);
+            if (opts.eeprom_size < EEPROM_MIN_SIZE_16BIT ||
+                opts.eeprom_size > EEPROM_MAX_SIZE ||
+                (opts.eeprom_size & (opts.eeprom_size - 1))) {
+                fprintf(stderr, "Invalid EEPROM size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case OPT_NO_VERIFY:
+            opts.no_verify = 1;
+            break;
+        case OPT_REPROBE:
+            opts.reprobe = 1;
+            break;
+        case OPT_VFIO:
+            opts.vfio = 1;
+            break;
+        case OPT_STATS:
+            opts.stats = 1;
+            break;
+        case OPT_CONNECT:
+            opts.connect = optarg;
+            break;
+        case OPT_FORCE:
+            opts.force = 1;
+            break;
+        case OPT_JSON:
+            opts.json = 1;
+            break;
+        case OPT_FW_CACHE:
+            opts.fw_cache = optarg ? optarg : FW_CACHE_DIR;
+            break;
+        case OPT_TIMEOUT:
+            opts.timeout_ms = atoi(optarg);
+            if (opts.timeout_ms <= 0) {
+                fprintf(stderr, "Invalid timeout: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv0);
+            return 1;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (opts.json) {
+        fflush(stdout);
+        opts.json_fd = dup(1);
+        dup2(2, 1);
+    }
+
+    if (argc >= 1 && argc <= 2 && !strcmp(argv[0], "scan")) {
+        // Probing would bind vfio-pci to every adapter in the system
+        if (opts.vfio) {
+            fprintf(stderr, "--vfio unbinds the kernel driver, so it cannot "
+                    "be used with scan\n");
+            return 1;
+        }
+        return !!do_scan(argc - 1, argv + 1);
+    }
+
+    if (argc < 2) {
+        usage(argv0);
         return 1;
     }
 
-    lsi_dev_t dev;
+    if (opts.connect)
+        return lsi_connect(opts.connect, argc, argv);
 
-    if (lsi_open(argv[1], &dev))
+    char *devs[MAX_DEVICES];
+
+    if (argc == 3 && !strcmp(argv[1], "serve")) {
+        // Workers open their devices up front, for every kind of request
+        if (opts.vfio) {
+            fprintf(stderr, "--vfio unbinds the kernel driver, so it cannot "
+                    "be used with serve\n");
+            return 1;
+        }
+        int count = lsi_parse_devices(argv[0], devs);
+        if (count <= 0)
+            return 1;
+        if (opts.realtime && lsi_go_realtime() < 0)
+            return 1;
+        return !!do_serve(devs, count, argv[2]);
+    }
+
+    int nops = argc - 1;
+    char **ops = argv + 1;
+
+    if (nops == 2 && !strcmp(ops[0], "script") &&
+        lsi_load_script(ops[1], &nops, &ops) < 0)
         return 1;
 
-    if (!strcmp(argv[2], "info")) {
-        return !!do_info(&dev);
-    } else if (!strcmp(argv[2], "readsbr") && argc == 4) {
-        return !!do_readsbr(&dev, argv[3]);
-    } else if (!strcmp(argv[2], "writesbr") && argc == 4) {
-        return !!do_writesbr(&dev, argv[3]);
-    } else if (!strcmp(argv[2], "reset")) {
-        return !!do_reset(&dev);
-    } else if (!strcmp(argv[2], "halt")) {
-        return !!do_halt(&dev);
-    } else if (!strcmp(argv[2], "hostboot") && argc == 4) {
-        return !!do_hostboot(&dev, argv[3]);
-    } else if (!strcmp(argv[2], "unbind")) {
-        return !!do_unbind(&dev);
-    } else if (!strcmp(argv[2], "rescan")) {
-        return !!do_rescan(&dev);
-    } else {
-        usage(argv[0]);
+    lsi_step_t steps[MAX_STEPS];
+    int nsteps = lsi_parse_steps(nops, ops, steps);
+    if (nsteps <= 0) {
+        usage(argv0);
         return 1;
     }
-    return 0;
+
+    int count = lsi_parse_devices(argv[0], devs);
+    if (count <= 0)
+        return 1;
+
+    for (int i = 0; i < nsteps && count > 1; i++) {
+        if ((steps[i].op->flags & OP_OUTPUT_FILE) &&
+            !strstr(steps[i].argv[0], "{}")) {
+            fprintf(stderr, "With multiple devices the output file name must "
+                    "contain {}\n");
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < nsteps && opts.data_fd < 0; i++) {
+        if ((steps[i].op->flags & OP_OUTPUT_FILE) &&
+            !strcmp(steps[i].argv[0], "-")) {
+            if (opts.json) {
+                fprintf(stderr, "--json and - output both need stdout\n");
+                return 1;
+            }
+            opts.data_fd = dup(1);
+            dup2(2, 1);
+        }
+    }
+
+    // One firmware image for every device: load and check it just once
+    for (int i = 0; i < nsteps && count > 1; i++) {
+        if (steps[i].op->fn == op_hostboot &&
+            !strstr(steps[i].argv[0], "{}")) {
+            if (lsi_share_firmware(steps[i].argv[0], devs, count) < 0)
+                return 1;
+            break;
+        }
+    }
+
+    if (opts.realtime && lsi_go_realtime() < 0)
+        return 1;
+
+    if (count == 1)
+        return lsi_run_one(devs[0], steps, nsteps);
+
+    return lsi_run_parallel(devs, count, steps, nsteps);
 }
@@ -0,0 +1,101 @@
+#!/usr/bin/python3
+import sys, struct
+
+HDR_FORMAT = "<8sIIQQQQQII"
+REG_FORMAT = "<B3xIII16s"
+ENTRY_FORMAT = "<QIHH"
+
+SPACES = ["bar", "dcr", "chip"]
+
+IOC_STATES = {
+    0x0: "RESET",
+    0x1: "READY",
+    0x2: "OPERATIONAL",
+    0x4: "FAULT",
+}
+
+def ioc_state(val):
+    if val == 0xffffffff:
+        return "DEAD"
+    state = IOC_STATES.get(val >> 28, "UNKNOWN")
+    if state == "FAULT":
+        state += " 0x%04x" % (val & 0xffff)
+    return state
+
+def load(fname):
+    data = open(fname, "rb").read()
+
+    hdr_size = struct.calcsize(HDR_FORMAT)
+    (magic, version, nregs, start, duration, samples, entries, dropped,
+     interval, _) = struct.unpack_from(HDR_FORMAT, data, 0)
+    if magic != b"LSIWATCH" or version != 1:
+        print("Not an lsirec watch trace (version 1)")
+        sys.exit(1)
+
+    hdr = {
+        "start": start,
+        "duration": duration,
+        "samples": samples,
+        "entries": entries,
+        "dropped": dropped,
+        "interval": interval,
+    }
+
+    regs = []
+    off = hdr_size
+    for i in range(nregs):
+        space, addr_high, addr, initial, name = struct.unpack_from(REG_FORMAT, data, off)
+        regs.append({
+            "space": SPACES[space],
+            "addr": (addr_high << 32) | addr,
+            "initial": initial,
+            "name": name.rstrip(b"\0").decode(),
+        })
+        off += struct.calcsize(REG_FORMAT)
+
+    trace = list(struct.iter_unpack(ENTRY_FORMAT, data[off:]))
+    if len(trace) != entries:
+        print("WARNING: trace has %d entries, header says %d" % (len(trace), entries))
+
+    return hdr, regs, trace
+
+def fmt_val(reg, val):
+    s = "0x%08x" % val
+    if reg["name"] == "doorbell":
+        s += " (%s)" % ioc_state(val)
+    return s
+
+def do_dump(fname):
+    hdr, regs, trace = load(fname)
+
+    print("Duration: %.3f ms, %d samples (%.3f us/sample), interval %d ns" % (
+        hdr["duration"] / 1e6, hdr["samples"],
+        hdr["duration"] / 1e3 / max(hdr["samples"], 1), hdr["interval"]))
+    if hdr["dropped"]:
+        print("WARNING: %d older transitions were dropped; initial values "
+              "below predate them" % hdr["dropped"])
+
+    print("Registers:")
+    last = []
+    for reg in regs:
+        print(" %-16s %s:0x%x = %s" % (reg["name"], reg["space"], reg["addr"],
+                                     fmt_val(reg, reg["initial"])))
+        last.append(reg["initial"])
+
+    print("Transitions:")
+    prev_t = 0
+    for t, val, i, _ in trace:
+        reg = regs[i]
+        print(" %12.3f us (+%10.3f) %-16s %s -> %s" % (
+            t / 1e3, (t - prev_t) / 1e3, reg["name"],
+            fmt_val(reg, last[i]), fmt_val(reg, val)))
+        last[i] = val
+        prev_t = t
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3 or sys.argv[1] not in ("dump",):
+        print("Usage:")
+        print(" %s dump trace.bin" % sys.argv[0])
+        sys.exit(1)
+    elif sys.argv[1] == "dump":
+        do_dump(sys.argv[2])